@@ -0,0 +1,480 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Command line modes that run without the UI.
+ *
+ * --dump and --watch print the heads as JSON, once or on every change.
+ *
+ * --apply applies a layout from a key file, for setting up outputs at boot.
+ * Each group is named after a head, by name or by description:
+ *
+ *   [HDMI-A-1]
+ *   enabled=true
+ *   mode=1920x1080@60
+ *   position=0,0
+ *   scale=1
+ *   transform=normal
+ *
+ * Every key is optional, and heads without a group keep their current state.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <wayland-client.h>
+
+#include "wdisplays.h"
+
+#define TEST_RETRIES_MAX 3
+
+static const char *const transform_names[] = {
+  [WL_OUTPUT_TRANSFORM_NORMAL] = "normal",
+  [WL_OUTPUT_TRANSFORM_90] = "90",
+  [WL_OUTPUT_TRANSFORM_180] = "180",
+  [WL_OUTPUT_TRANSFORM_270] = "270",
+  [WL_OUTPUT_TRANSFORM_FLIPPED] = "flipped",
+  [WL_OUTPUT_TRANSFORM_FLIPPED_90] = "flipped-90",
+  [WL_OUTPUT_TRANSFORM_FLIPPED_180] = "flipped-180",
+  [WL_OUTPUT_TRANSFORM_FLIPPED_270] = "flipped-270",
+};
+
+#define TRANSFORM_NAME_MAX 11 // fits any uint32_t
+
+/*
+ * The compositor may send a transform newer than this table; those are
+ * written as their number.
+ */
+static const char *transform_name(enum wl_output_transform transform,
+    char buf[TRANSFORM_NAME_MAX]) {
+  if ((unsigned) transform < G_N_ELEMENTS(transform_names))
+    return transform_names[transform];
+  snprintf(buf, TRANSFORM_NAME_MAX, "%u", (unsigned) transform);
+  return buf;
+}
+
+static const char *find_group(GKeyFile *file, const struct wd_head *head) {
+  if (head->name != NULL && g_key_file_has_group(file, head->name))
+    return head->name;
+  if (head->description != NULL && g_key_file_has_group(file, head->description))
+    return head->description;
+  return NULL;
+}
+
+static bool parse_mode(const char *str, struct wd_head_config *output) {
+  int width, height;
+  double refresh = 0.;
+  int n = sscanf(str, "%dx%d@%lf", &width, &height, &refresh);
+  if (n < 2 || width <= 0 || height <= 0 || refresh < 0.)
+    return false;
+  output->width = width;
+  output->height = height;
+  if (n == 3) {
+    output->refresh = refresh * 1000. + .5;
+  } else {
+    /* the head's fastest mode of that size */
+    output->refresh = 0;
+    struct wd_mode *mode;
+    wl_list_for_each(mode, &output->head->modes, link) {
+      if (mode->width == width && mode->height == height
+          && mode->refresh > output->refresh)
+        output->refresh = mode->refresh;
+    }
+  }
+  return true;
+}
+
+static void use_preferred_mode(struct wd_head_config *output) {
+  struct wd_mode *mode;
+  wl_list_for_each(mode, &output->head->modes, link) {
+    if (mode->preferred) {
+      output->width = mode->width;
+      output->height = mode->height;
+      output->refresh = mode->refresh;
+      return;
+    }
+  }
+}
+
+static bool parse_group(GKeyFile *file, const char *group,
+    struct wd_head_config *output) {
+  g_autoptr(GError) error = NULL;
+  if (g_key_file_has_key(file, group, "enabled", NULL)) {
+    output->enabled = g_key_file_get_boolean(file, group, "enabled", &error);
+    if (error != NULL) {
+      fprintf(stderr, "[%s]: %s\n", group, error->message);
+      return false;
+    }
+  }
+  g_autofree gchar *mode = g_key_file_get_string(file, group, "mode", NULL);
+  if (mode != NULL && !parse_mode(mode, output)) {
+    fprintf(stderr, "[%s]: mode must be WIDTHxHEIGHT or WIDTHxHEIGHT@HZ\n", group);
+    return false;
+  }
+  if (mode == NULL && output->enabled && !output->head->enabled) {
+    /* a head being turned on has no current mode to keep */
+    use_preferred_mode(output);
+  }
+  g_autofree gchar *position = g_key_file_get_string(file, group, "position", NULL);
+  if (position != NULL
+      && sscanf(position, "%d,%d", &output->x, &output->y) != 2) {
+    fprintf(stderr, "[%s]: position must be X,Y\n", group);
+    return false;
+  }
+  if (g_key_file_has_key(file, group, "scale", NULL)) {
+    output->scale = g_key_file_get_double(file, group, "scale", &error);
+    if (error != NULL) {
+      fprintf(stderr, "[%s]: %s\n", group, error->message);
+      return false;
+    }
+    if (output->scale <= 0.) {
+      fprintf(stderr, "[%s]: scale must be positive\n", group);
+      return false;
+    }
+  }
+  g_autofree gchar *transform = g_key_file_get_string(file, group, "transform", NULL);
+  if (transform != NULL) {
+    size_t i;
+    for (i = 0; i < G_N_ELEMENTS(transform_names); i++) {
+      if (strcmp(transform, transform_names[i]) == 0)
+        break;
+    }
+    if (i == G_N_ELEMENTS(transform_names)) {
+      fprintf(stderr, "[%s]: unknown transform %s\n", group, transform);
+      return false;
+    }
+    output->transform = i;
+  }
+  return true;
+}
+
+static void free_configs(struct wl_list *outputs) {
+  struct wd_head_config *output, *tmp;
+  wl_list_for_each_safe(output, tmp, outputs, link) {
+    wl_list_remove(&output->link);
+    free(output);
+  }
+  free(outputs);
+}
+
+/*
+ * Configures every head, from its group in the file if it has one. Returns
+ * NULL if the file has errors.
+ */
+static struct wl_list *build_configs(struct wd_state *state, GKeyFile *file) {
+  struct wl_list *outputs = calloc(1, sizeof(*outputs));
+  wl_list_init(outputs);
+
+  g_autoptr(GHashTable) used = g_hash_table_new(g_str_hash, g_str_equal);
+  struct wd_head *head;
+  wl_list_for_each(head, &state->heads, link) {
+    struct wd_head_config *output = wd_head_config_new(head);
+    wl_list_insert(outputs->prev, &output->link);
+    const char *group = find_group(file, head);
+    if (group == NULL)
+      continue;
+    g_hash_table_add(used, (gpointer) group);
+    if (!parse_group(file, group, output)) {
+      free_configs(outputs);
+      return NULL;
+    }
+  }
+
+  g_auto(GStrv) groups = g_key_file_get_groups(file, NULL);
+  for (gchar **group = groups; *group != NULL; group++) {
+    if (!g_hash_table_contains(used, *group))
+      fprintf(stderr, "No output matches [%s], skipping it\n", *group);
+  }
+  return outputs;
+}
+
+static void print_configs(struct wl_list *outputs) {
+  struct wd_head_config *output;
+  wl_list_for_each(output, outputs, link) {
+    if (!output->enabled) {
+      printf("%s: disabled\n", output->head->name);
+      continue;
+    }
+    bool advertised = wd_head_find_mode(output->head,
+        output->width, output->height, output->refresh) != NULL;
+    char transform[TRANSFORM_NAME_MAX];
+    printf("%s: %dx%d@%.3fHz%s at %d,%d scale %g transform %s\n",
+        output->head->name, output->width, output->height,
+        output->refresh / 1000., advertised ? "" : " (custom)",
+        output->x, output->y, output->scale,
+        transform_name(output->transform, transform));
+  }
+}
+
+static int run_test(struct wd_state *state, GKeyFile *file,
+    struct wl_display *display) {
+  for (int attempt = 0; attempt <= TEST_RETRIES_MAX; attempt++) {
+    struct wl_list *outputs = build_configs(state, file);
+    if (outputs == NULL)
+      return 1;
+    wd_test_state(state, outputs, display);
+    while (state->test_result == WD_TEST_PENDING) {
+      if (wl_display_dispatch(display) == -1) {
+        fprintf(stderr, "Lost the connection to the compositor\n");
+        return 1;
+      }
+    }
+    if (state->test_result != WD_TEST_CANCELLED) {
+      bool succeeded = state->test_result == WD_TEST_SUCCEEDED;
+      printf("The compositor %s this layout\n",
+          succeeded ? "accepts" : "rejects");
+      return succeeded ? 0 : 1;
+    }
+    /* the outputs changed under the test, rebuild on the new state */
+    wl_display_roundtrip(display);
+  }
+  fprintf(stderr, "The outputs kept changing, giving up\n");
+  return 1;
+}
+
+static int run_apply(struct wd_state *state, GKeyFile *file,
+    struct wl_display *display) {
+  struct wl_list *outputs = build_configs(state, file);
+  if (outputs == NULL)
+    return 1;
+  uint64_t successes = state->metrics.apply_successes;
+  wd_apply_state(state, outputs, display);
+  while (state->apply_inflight != NULL) {
+    if (wl_display_dispatch(display) == -1) {
+      fprintf(stderr, "Lost the connection to the compositor\n");
+      return 1;
+    }
+  }
+  if (state->metrics.apply_successes == successes)
+    return 1;
+  g_debug("apply succeeded after %.1fms", state->apply_latency / 1000.);
+  return 0;
+}
+
+int wd_cli_apply(const char *path, bool dry_run, bool test_only) {
+  g_autoptr(GKeyFile) file = g_key_file_new();
+  g_autoptr(GError) error = NULL;
+  if (!g_key_file_load_from_file(file, path, G_KEY_FILE_NONE, &error)) {
+    fprintf(stderr, "%s: %s\n", path, error->message);
+    return 1;
+  }
+
+  struct wl_display *display = wl_display_connect(NULL);
+  if (display == NULL) {
+    fprintf(stderr, "Can't connect to the Wayland display\n");
+    return 1;
+  }
+  struct wd_state *state = wd_state_create();
+  state->capture = false;
+  state->show_overlay = false;
+  wd_add_output_management_listener(state, display);
+
+  int status = 1;
+  if (state->output_manager == NULL) {
+    fprintf(stderr, "Compositor doesn't support wlr-output-management-unstable-v1\n");
+  } else if (dry_run) {
+    struct wl_list *outputs = build_configs(state, file);
+    if (outputs != NULL) {
+      print_configs(outputs);
+      free_configs(outputs);
+      status = 0;
+    }
+  } else if (test_only) {
+    status = run_test(state, file, display);
+  } else {
+    status = run_apply(state, file, display);
+  }
+
+  wd_state_destroy(state);
+  wl_display_disconnect(display);
+  return status;
+}
+
+static void append_json_string(GString *json, const char *str) {
+  if (str == NULL) {
+    g_string_append(json, "null");
+    return;
+  }
+  g_string_append_c(json, '"');
+  for (const unsigned char *c = (const unsigned char *) str; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      g_string_append_c(json, '\\');
+      g_string_append_c(json, *c);
+    } else if (*c < 0x20) {
+      g_string_append_printf(json, "\\u%04x", *c);
+    } else {
+      g_string_append_c(json, *c);
+    }
+  }
+  g_string_append_c(json, '"');
+}
+
+static void append_json_double(GString *json, const char *format, double value) {
+  char buf[G_ASCII_DTOSTR_BUF_SIZE];
+  g_string_append(json, g_ascii_formatd(buf, sizeof(buf), format, value));
+}
+
+static void append_json_mode(GString *json, int32_t width, int32_t height,
+    int32_t refresh) {
+  g_string_append_printf(json, "{\"width\":%d,\"height\":%d,\"refresh\":",
+      width, height);
+  append_json_double(json, "%.3f", refresh / 1000.);
+}
+
+/*
+ * Appends the head as an object with the given fields. The id and name are
+ * always there, so deltas can be matched up.
+ */
+static void append_json_head(GString *json, const struct wd_head *head,
+    enum wd_head_fields fields) {
+  g_string_append_printf(json, "{\"id\":%u,\"name\":", head->id);
+  append_json_string(json, head->name);
+  if (fields & WD_FIELD_DESCRIPTION) {
+    g_string_append(json, ",\"description\":");
+    append_json_string(json, head->description);
+  }
+  if (fields & WD_FIELD_PHYSICAL_SIZE) {
+    g_string_append_printf(json,
+        ",\"physical_size\":{\"width\":%d,\"height\":%d}",
+        head->phys_width, head->phys_height);
+  }
+  if (fields & WD_FIELD_ENABLED) {
+    g_string_append_printf(json, ",\"enabled\":%s",
+        head->enabled ? "true" : "false");
+  }
+  if (fields & WD_FIELD_MODE) {
+    g_string_append(json, ",\"mode\":");
+    if (head->mode != NULL) {
+      append_json_mode(json, head->mode->width, head->mode->height,
+          head->mode->refresh);
+      g_string_append(json, ",\"custom\":false}");
+    } else if (head->enabled) {
+      append_json_mode(json, head->custom_mode.width,
+          head->custom_mode.height, head->custom_mode.refresh);
+      g_string_append(json, ",\"custom\":true}");
+    } else {
+      g_string_append(json, "null");
+    }
+    g_string_append(json, ",\"modes\":[");
+    const struct wd_mode *mode;
+    bool first = true;
+    wl_list_for_each(mode, &head->modes, link) {
+      if (!first)
+        g_string_append_c(json, ',');
+      first = false;
+      append_json_mode(json, mode->width, mode->height, mode->refresh);
+      g_string_append_printf(json, ",\"preferred\":%s}",
+          mode->preferred ? "true" : "false");
+    }
+    g_string_append_c(json, ']');
+  }
+  if (fields & WD_FIELD_POSITION) {
+    g_string_append_printf(json, ",\"position\":{\"x\":%d,\"y\":%d}",
+        head->x, head->y);
+  }
+  if (fields & WD_FIELD_SCALE) {
+    g_string_append(json, ",\"scale\":");
+    append_json_double(json, "%g", head->scale);
+  }
+  if (fields & WD_FIELD_TRANSFORM) {
+    char transform[TRANSFORM_NAME_MAX];
+    g_string_append(json, ",\"transform\":");
+    append_json_string(json, transform_name(head->transform, transform));
+  }
+  g_string_append_c(json, '}');
+}
+
+static bool watching;
+static bool dumped;
+static GHashTable *watched_ids; // heads reported so far
+
+static void print_json(GString *json) {
+  g_string_append_c(json, '\n');
+  fputs(json->str, stdout);
+  fflush(stdout);
+}
+
+/*
+ * Prints all heads once, or with --watch, the heads that changed in this done
+ * event and those that went away since the last one.
+ */
+static void dump_done(struct wd_state *state) {
+  g_autoptr(GString) json = g_string_new(NULL);
+  g_string_append_printf(json, "{\"serial\":%u,\"heads\":[", state->serial);
+  g_autoptr(GHashTable) ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+  bool first = true;
+  struct wd_head *head;
+  wl_list_for_each(head, &state->heads, link) {
+    g_hash_table_add(ids, GUINT_TO_POINTER(head->id));
+    enum wd_head_fields fields = watching ? head->dirty : WD_FIELDS_ALL;
+    if (watched_ids != NULL
+        && !g_hash_table_contains(watched_ids, GUINT_TO_POINTER(head->id)))
+      fields = WD_FIELDS_ALL;
+    if (fields == 0)
+      continue;
+    if (!first)
+      g_string_append_c(json, ',');
+    first = false;
+    append_json_head(json, head, fields);
+  }
+  g_string_append_c(json, ']');
+
+  if (watching) {
+    g_string_append(json, ",\"removed\":[");
+    first = true;
+    GHashTableIter iter;
+    gpointer id;
+    g_hash_table_iter_init(&iter, watched_ids);
+    while (g_hash_table_iter_next(&iter, &id, NULL)) {
+      if (g_hash_table_contains(ids, id))
+        continue;
+      g_string_append_printf(json, "%s%u", first ? "" : ",",
+          GPOINTER_TO_UINT(id));
+      first = false;
+    }
+    g_string_append_c(json, ']');
+    g_hash_table_unref(watched_ids);
+    watched_ids = g_steal_pointer(&ids);
+  }
+  g_string_append_c(json, '}');
+  print_json(json);
+  dumped = true;
+}
+
+int wd_cli_dump(bool watch) {
+  struct wl_display *display = wl_display_connect(NULL);
+  if (display == NULL) {
+    fprintf(stderr, "Can't connect to the Wayland display\n");
+    return 1;
+  }
+  struct wd_state *state = wd_state_create();
+  state->capture = false;
+  state->show_overlay = false;
+  state->done_hook = dump_done;
+  watching = watch;
+  if (watch)
+    watched_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  struct wl_registry *registry = wd_listen_registry(state, display);
+  wl_display_roundtrip(display);
+
+  int status = 0;
+  if (state->output_manager == NULL) {
+    fprintf(stderr, "Compositor doesn't support wlr-output-management-unstable-v1\n");
+    status = 1;
+  }
+  while (status == 0 && (watch || !dumped)) {
+    if (wl_display_dispatch(display) == -1) {
+      fprintf(stderr, "Lost the connection to the compositor\n");
+      status = 1;
+    }
+  }
+
+  g_clear_pointer(&watched_ids, g_hash_table_unref);
+  wd_state_destroy(state);
+  wl_registry_destroy(registry);
+  wl_display_disconnect(display);
+  return status;
+}
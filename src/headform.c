@@ -4,6 +4,8 @@
 #include "headform.h"
 #include "wdisplays.h"
 
+#include <math.h>
+
 typedef struct _WdHeadFormPrivate {
   GtkWidget *enabled;
   GtkWidget *description;
@@ -20,6 +22,11 @@ typedef struct _WdHeadFormPrivate {
 
   GAction *mode_action;
   GAction *rotate_action;
+
+  GtkWidget *mode_popover;
+  GArray *modes; // struct vid_mode, as listed in the mode menu
+  gboolean mode_menu_stale;
+  gboolean updating;
 } WdHeadFormPrivate;
 
 enum {
@@ -36,6 +43,17 @@ static const char *HEAD_PREFIX = "head";
 static const char *MODE_PREFIX = "mode";
 static const char *ROTATE_PREFIX = "rotate";
 
+/*
+ * Widget callbacks fired while wd_head_form_update is syncing the form to the
+ * head are folded into the single emission at the end of the update.
+ */
+static void emit_changed(WdHeadForm *form, enum wd_head_fields fields) {
+  WdHeadFormPrivate *priv = wd_head_form_get_instance_private(form);
+  if (!priv->updating) {
+    g_signal_emit(form, signals[CHANGED], 0, fields);
+  }
+}
+
 static void head_form_update_sensitivity(WdHeadForm *form) {
   WdHeadFormPrivate *priv = wd_head_form_get_instance_private(form);
 
@@ -77,7 +95,7 @@ static void unpack_mode_variant(GVariant *value, struct vid_mode *mode) {
 static void enabled_toggled(GtkToggleButton *toggle, gpointer data) {
   WdHeadForm *form = WD_HEAD_FORM(data);
   head_form_update_sensitivity(form);
-  g_signal_emit(form, signals[CHANGED], 0, WD_FIELD_ENABLED);
+  emit_changed(form, WD_FIELD_ENABLED);
 }
 
 static void mode_spin_changed(GtkSpinButton *spin_button, gpointer data) {
@@ -94,22 +112,31 @@ static void mode_spin_changed(GtkSpinButton *spin_button, gpointer data) {
     mode.refresh = gtk_spin_button_get_value(spin_button) * 1000.;
   }
   g_action_activate(priv->mode_action, create_mode_variant(mode.width, mode.height, mode.refresh));
-  g_signal_emit(form, signals[CHANGED], 0, WD_FIELD_MODE);
+  emit_changed(form, WD_FIELD_MODE);
 }
 
 static void position_spin_changed(GtkSpinButton *spin_button, gpointer data) {
   WdHeadForm *form = WD_HEAD_FORM(data);
-  g_signal_emit(form, signals[CHANGED], 0, WD_FIELD_POSITION);
+  emit_changed(form, WD_FIELD_POSITION);
 }
 
 static void flipped_toggled(GtkToggleButton *toggle, gpointer data) {
   WdHeadForm *form = WD_HEAD_FORM(data);
-  g_signal_emit(form, signals[CHANGED], 0, WD_FIELD_TRANSFORM);
+  emit_changed(form, WD_FIELD_TRANSFORM);
+}
+
+static void wd_head_form_finalize(GObject *object) {
+  WdHeadFormPrivate *priv = wd_head_form_get_instance_private(WD_HEAD_FORM(object));
+  g_array_unref(priv->modes);
+  G_OBJECT_CLASS(wd_head_form_parent_class)->finalize(object);
 }
 
 static void wd_head_form_class_init(WdHeadFormClass *class) {
+  GObjectClass *object_class = G_OBJECT_CLASS(class);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(class);
 
+  object_class->finalize = wd_head_form_finalize;
+
   signals[CHANGED] = g_signal_new("changed",
       G_OBJECT_CLASS_TYPE(class),
       G_SIGNAL_RUN_LAST,
@@ -165,7 +192,7 @@ static void rotate_selected(GSimpleAction *action, GVariant *param, gpointer dat
     }
   }
   g_simple_action_set_state(action, param);
-  g_signal_emit(form, signals[CHANGED], 0, WD_FIELD_TRANSFORM);
+  emit_changed(form, WD_FIELD_TRANSFORM);
 }
 
 static void mode_selected(GSimpleAction *action, GVariant *param, gpointer data) {
@@ -178,17 +205,120 @@ static void mode_selected(GSimpleAction *action, GVariant *param, gpointer data)
   gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->width), mode.width);
   gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->height), mode.height);
   gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->refresh), mode.refresh / 1000.);
-  g_signal_emit(form, signals[CHANGED], 0, WD_FIELD_MODE);
+  emit_changed(form, WD_FIELD_MODE);
+}
+
+/*
+ * The spin button rounds to its digits, so a scale like 4/3 never reads back
+ * exactly. Compare at the precision it shows instead.
+ */
+static gboolean scale_changed(GtkWidget *spin_button, double scale) {
+  GtkSpinButton *spin = GTK_SPIN_BUTTON(spin_button);
+  double value = gtk_spin_button_get_value(spin);
+  return fabs(value - scale)
+    >= .5 * pow(10., -(int) gtk_spin_button_get_digits(spin));
+}
+
+static gboolean mode_list_changed(WdHeadFormPrivate *priv,
+    const struct wd_head *head) {
+  size_t len = head->mode_table != NULL ? head->mode_table->len : 0;
+  if (len != priv->modes->len)
+    return TRUE;
+  for (size_t i = 0; i < len; i++) {
+    const struct wd_mode_entry *entry = &head->mode_table->entries[i];
+    struct vid_mode *listed = &g_array_index(priv->modes, struct vid_mode, i);
+    if (listed->width != entry->width || listed->height != entry->height
+        || listed->refresh != entry->refresh)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static void update_mode_list(WdHeadFormPrivate *priv,
+    const struct wd_head *head) {
+  g_array_set_size(priv->modes, 0);
+  size_t len = head->mode_table != NULL ? head->mode_table->len : 0;
+  for (size_t i = 0; i < len; i++) {
+    const struct wd_mode_entry *entry = &head->mode_table->entries[i];
+    struct vid_mode listed = {
+      .width = entry->width,
+      .height = entry->height,
+      .refresh = entry->refresh,
+    };
+    g_array_append_val(priv->modes, listed);
+  }
+  priv->mode_menu_stale = TRUE;
+}
+
+static GMenuItem *create_mode_item(const char *label, const char *action,
+    const struct vid_mode *mode) {
+  GMenuItem *item = g_menu_item_new(label, action);
+  g_menu_item_set_attribute_value(item, G_MENU_ATTRIBUTE_TARGET,
+      create_mode_variant(mode->width, mode->height, mode->refresh));
+  return item;
+}
+
+/*
+ * Builds the mode menu the first time it is opened after the mode list
+ * changed. The list is sorted, so modes with the same resolution are
+ * adjacent and get grouped into a submenu of refresh rates.
+ */
+static void mode_popover_show(GtkWidget *popover, gpointer data) {
+  WdHeadForm *form = data;
+  WdHeadFormPrivate *priv = wd_head_form_get_instance_private(form);
+  if (!priv->mode_menu_stale)
+    return;
+
+  GMenu *mode_menu = g_menu_new();
+  g_autofree gchar *action = g_strdup_printf("%s.%s", HEAD_PREFIX, MODE_PREFIX);
+  guint i = 0;
+  while (i < priv->modes->len) {
+    const struct vid_mode *first = &g_array_index(priv->modes, struct vid_mode, i);
+    guint end = i + 1;
+    while (end < priv->modes->len) {
+      const struct vid_mode *mode = &g_array_index(priv->modes, struct vid_mode, end);
+      if (mode->width != first->width || mode->height != first->height)
+        break;
+      end++;
+    }
+    if (end - i == 1) {
+      g_autofree gchar *name = g_strdup_printf("%d×%d@%0.3fHz", first->width, first->height, first->refresh / 1000.);
+      GMenuItem *item = create_mode_item(name, action, first);
+      g_menu_append_item(mode_menu, item);
+      g_object_unref(item);
+    } else {
+      GMenu *refresh_menu = g_menu_new();
+      for (; i < end; i++) {
+        const struct vid_mode *mode = &g_array_index(priv->modes, struct vid_mode, i);
+        g_autofree gchar *name = g_strdup_printf("%0.3fHz", mode->refresh / 1000.);
+        GMenuItem *item = create_mode_item(name, action, mode);
+        g_menu_append_item(refresh_menu, item);
+        g_object_unref(item);
+      }
+      g_autofree gchar *name = g_strdup_printf("%d×%d", first->width, first->height);
+      g_menu_append_submenu(mode_menu, name, G_MENU_MODEL(refresh_menu));
+      g_object_unref(refresh_menu);
+    }
+    i = end;
+  }
+  gtk_popover_bind_model(GTK_POPOVER(popover), G_MENU_MODEL(mode_menu), NULL);
+  g_object_unref(mode_menu);
+  priv->mode_menu_stale = FALSE;
 }
 
 static void wd_head_form_init(WdHeadForm *form) {
   gtk_widget_init_template(GTK_WIDGET(form));
   WdHeadFormPrivate *priv = wd_head_form_get_instance_private(form);
+  priv->modes = g_array_new(FALSE, FALSE, sizeof(struct vid_mode));
 
   GSimpleActionGroup *head_actions = g_simple_action_group_new();
   gtk_widget_insert_action_group(priv->mode_button, HEAD_PREFIX, G_ACTION_GROUP(head_actions));
   gtk_widget_insert_action_group(priv->rotate_button, HEAD_PREFIX, G_ACTION_GROUP(head_actions));
 
+  priv->mode_popover = gtk_popover_new(priv->mode_button);
+  g_signal_connect(priv->mode_popover, "show", G_CALLBACK(mode_popover_show), form);
+  gtk_menu_button_set_popover(GTK_MENU_BUTTON(priv->mode_button), priv->mode_popover);
+
   GMenu *rotate_menu = g_menu_new();
   g_menu_append(rotate_menu, "Don't Rotate", "head.rotate(0)");
   g_menu_append(rotate_menu, "Rotate 90°", "head.rotate(90)");
@@ -219,6 +349,17 @@ static void wd_head_form_init(WdHeadForm *form) {
   g_object_unref(head_actions);
 }
 
+static inline bool is_flipped(enum wl_output_transform transform) {
+  return transform == WL_OUTPUT_TRANSFORM_FLIPPED
+    || transform == WL_OUTPUT_TRANSFORM_FLIPPED_90
+    || transform == WL_OUTPUT_TRANSFORM_FLIPPED_180
+    || transform == WL_OUTPUT_TRANSFORM_FLIPPED_270;
+}
+
+/*
+ * Only widgets whose value differs from the head are touched, and the
+ * changed signal is only emitted if at least one of them was.
+ */
 void wd_head_form_update(WdHeadForm *form, const struct wd_head *head,
     enum wd_head_fields fields) {
   g_return_if_fail(form);
@@ -228,33 +369,46 @@ void wd_head_form_update(WdHeadForm *form, const struct wd_head *head,
   if (!fields)
     return;
 
-  if (fields & WD_FIELD_DESCRIPTION)
+  enum wd_head_fields changed = 0;
+  priv->updating = TRUE;
+
+  if (fields & WD_FIELD_DESCRIPTION
+      && g_strcmp0(gtk_label_get_text(GTK_LABEL(priv->description)), head->description) != 0) {
     gtk_label_set_text(GTK_LABEL(priv->description), head->description);
+    changed |= WD_FIELD_DESCRIPTION;
+  }
   if (fields & WD_FIELD_PHYSICAL_SIZE) {
     g_autofree gchar *physical_str = g_strdup_printf("%dmm × %dmm", head->phys_width, head->phys_height);
-    gtk_label_set_text(GTK_LABEL(priv->physical_size), physical_str);
+    if (g_strcmp0(gtk_label_get_text(GTK_LABEL(priv->physical_size)), physical_str) != 0) {
+      gtk_label_set_text(GTK_LABEL(priv->physical_size), physical_str);
+      changed |= WD_FIELD_PHYSICAL_SIZE;
+    }
   }
-  if (fields & WD_FIELD_ENABLED)
+  if (fields & WD_FIELD_ENABLED
+      && gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->enabled)) != head->enabled) {
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(priv->enabled), head->enabled);
-  if (fields & WD_FIELD_SCALE)
+    changed |= WD_FIELD_ENABLED;
+  }
+  if (fields & WD_FIELD_SCALE && scale_changed(priv->scale, head->scale)) {
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->scale), head->scale);
+    changed |= WD_FIELD_SCALE;
+  }
   if (fields & WD_FIELD_POSITION) {
-    gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->pos_x), head->x);
-    gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->pos_y), head->y);
+    if (gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->pos_x)) != head->x) {
+      gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->pos_x), head->x);
+      changed |= WD_FIELD_POSITION;
+    }
+    if (gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->pos_y)) != head->y) {
+      gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->pos_y), head->y);
+      changed |= WD_FIELD_POSITION;
+    }
   }
 
   if (fields & WD_FIELD_MODE) {
-    GMenu *mode_menu = g_menu_new();
-    struct wd_mode *mode;
-    g_autofree gchar *action = g_strdup_printf("%s.%s", HEAD_PREFIX, MODE_PREFIX);
-    wl_list_for_each(mode, &head->modes, link) {
-      g_autofree gchar *name = g_strdup_printf("%d×%d@%0.3fHz", mode->width, mode->height, mode->refresh / 1000.);
-      GMenuItem *item = g_menu_item_new(name, action);
-      g_menu_item_set_attribute_value(item, G_MENU_ATTRIBUTE_TARGET,
-          create_mode_variant(mode->width, mode->height, mode->refresh));
-      g_menu_append_item(mode_menu, item);
+    if (mode_list_changed(priv, head)) {
+      update_mode_list(priv, head);
+      changed |= WD_FIELD_MODE;
     }
-    gtk_menu_button_set_menu_model(GTK_MENU_BUTTON(priv->mode_button), G_MENU_MODEL(mode_menu));
     // Mode entries
     int w = head->custom_mode.width;
     int h = head->custom_mode.height;
@@ -263,37 +417,49 @@ void wd_head_form_update(WdHeadForm *form, const struct wd_head *head,
       w = head->mode->width;
       h = head->mode->height;
       r = head->mode->refresh;
-    } else if (!head->enabled && w == 0 && h == 0) {
-      struct wd_mode *mode;
-      wl_list_for_each(mode, &head->modes, link) {
-        if (mode->preferred) {
-          w = mode->width;
-          h = mode->height;
-          r = mode->refresh;
+    } else if (!head->enabled && w == 0 && h == 0 && head->mode_table != NULL) {
+      for (size_t i = 0; i < head->mode_table->len; i++) {
+        const struct wd_mode_entry *entry = &head->mode_table->entries[i];
+        if (entry->preferred) {
+          w = entry->width;
+          h = entry->height;
+          r = entry->refresh;
           break;
         }
       }
     }
 
-    g_action_change_state(priv->mode_action, create_mode_variant(w, h, r));
+    g_autoptr(GVariant) current = g_action_get_state(priv->mode_action);
+    GVariant *target = g_variant_ref_sink(create_mode_variant(w, h, r));
+    if (!g_variant_equal(current, target)) {
+      g_action_change_state(priv->mode_action, target);
+      changed |= WD_FIELD_MODE;
+    }
+    g_variant_unref(target);
   }
 
   if (fields & WD_FIELD_TRANSFORM) {
     int active_rotate = get_rotate_value(head->transform);
-    g_action_change_state(priv->rotate_action, g_variant_new_int32(active_rotate));
+    g_autoptr(GVariant) rotate = g_action_get_state(priv->rotate_action);
+    if (g_variant_get_int32(rotate) != active_rotate) {
+      g_action_change_state(priv->rotate_action, g_variant_new_int32(active_rotate));
+      changed |= WD_FIELD_TRANSFORM;
+    }
 
-    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(priv->flipped),
-        head->transform == WL_OUTPUT_TRANSFORM_FLIPPED
-        || head->transform == WL_OUTPUT_TRANSFORM_FLIPPED_90
-        || head->transform == WL_OUTPUT_TRANSFORM_FLIPPED_180
-        || head->transform == WL_OUTPUT_TRANSFORM_FLIPPED_270);
+    bool flipped = is_flipped(head->transform);
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->flipped)) != flipped) {
+      gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(priv->flipped), flipped);
+      changed |= WD_FIELD_TRANSFORM;
+    }
   }
 
   // Sync state
   if (fields & WD_FIELD_ENABLED) {
     head_form_update_sensitivity(form);
   }
-  g_signal_emit(form, signals[CHANGED], 0);
+  priv->updating = FALSE;
+  if (changed)
+    g_signal_emit(form, signals[CHANGED], 0, changed);
 }
 
 GtkWidget *wd_head_form_new(void) {
@@ -312,9 +478,7 @@ gboolean wd_head_form_has_changes(WdHeadForm *form, const struct wd_head *head)
   if (head->enabled != gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->enabled))) {
     return TRUE;
   }
-  double old_scale = round(head->scale * 100.) / 100.;
-  double new_scale = round(gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->scale)) * 100.) / 100.;
-  if (old_scale != new_scale) {
+  if (scale_changed(priv->scale, head->scale)) {
     return TRUE;
   }
   if (head->x != gtk_spin_button_get_value(GTK_SPIN_BUTTON(priv->pos_x))) {
@@ -338,11 +502,7 @@ gboolean wd_head_form_has_changes(WdHeadForm *form, const struct wd_head *head)
   if (g_variant_get_int32(g_action_get_state(priv->rotate_action)) != get_rotate_value(head->transform)) {
     return TRUE;
   }
-  bool flipped = head->transform == WL_OUTPUT_TRANSFORM_FLIPPED
-    || head->transform == WL_OUTPUT_TRANSFORM_FLIPPED_90
-    || head->transform == WL_OUTPUT_TRANSFORM_FLIPPED_180
-    || head->transform == WL_OUTPUT_TRANSFORM_FLIPPED_270;
-  if (flipped != gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->flipped))) {
+  if (is_flipped(head->transform) != gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(priv->flipped))) {
     return TRUE;
   }
   return FALSE;
@@ -0,0 +1,157 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+#include <math.h>
+
+#include "layout.h"
+
+struct wd_point wd_layout_size(const struct wd_layout_head *head) {
+  struct wd_point size = { .x = head->width, .y = head->height };
+  if (head->rotation & 1) {
+    size.x = head->height;
+    size.y = head->width;
+  }
+  if (head->scale > 0.) {
+    size.x /= head->scale;
+    size.y /= head->scale;
+  }
+  return size;
+}
+
+struct wd_box wd_layout_box(const struct wd_layout_head *head) {
+  struct wd_point size = wd_layout_size(head);
+  return (struct wd_box) {
+    .x1 = head->x,
+    .y1 = head->y,
+    .x2 = head->x + size.x,
+    .y2 = head->y + size.y,
+  };
+}
+
+struct wd_rect wd_layout_rect(const struct wd_layout_head *head) {
+  struct wd_box box = wd_layout_box(head);
+  return (struct wd_rect) {
+    .x1 = box.x1,
+    .y1 = box.y1,
+    .x2 = box.x2,
+    .y2 = box.y2,
+  };
+}
+
+bool wd_rect_equal(const struct wd_rect *a, const struct wd_rect *b) {
+  return a->x1 == b->x1 && a->y1 == b->y1 && a->x2 == b->x2 && a->y2 == b->y2;
+}
+
+void wd_extent_add(struct wd_canvas_extent *extent,
+    const struct wd_rect *rect) {
+  if (extent->heads++ == 0) {
+    extent->xmin = rect->x1;
+    extent->ymin = rect->y1;
+    extent->xmax = rect->x2;
+    extent->ymax = rect->y2;
+    extent->xmin_count = extent->ymin_count = 1;
+    extent->xmax_count = extent->ymax_count = 1;
+    return;
+  }
+#define EXTEND(_edge, _value, _cmp) \
+  if ((_value) _cmp extent->_edge) { \
+    extent->_edge = (_value); \
+    extent->_edge##_count = 1; \
+  } else if ((_value) == extent->_edge) { \
+    extent->_edge##_count++; \
+  }
+  EXTEND(xmin, rect->x1, <)
+  EXTEND(ymin, rect->y1, <)
+  EXTEND(xmax, rect->x2, >)
+  EXTEND(ymax, rect->y2, >)
+#undef EXTEND
+}
+
+void wd_extent_remove(struct wd_canvas_extent *extent,
+    const struct wd_rect *rect) {
+  extent->heads--;
+  if ((rect->x1 == extent->xmin && --extent->xmin_count == 0)
+      | (rect->y1 == extent->ymin && --extent->ymin_count == 0)
+      | (rect->x2 == extent->xmax && --extent->xmax_count == 0)
+      | (rect->y2 == extent->ymax && --extent->ymax_count == 0)) {
+    extent->stale = true;
+  }
+}
+
+void wd_layout_canvas(const struct wd_canvas_extent *extent, double zoom,
+    int margin, struct wd_canvas_geometry *canvas) {
+  int xmin = 0;
+  int xmax = 0;
+  int ymin = 0;
+  int ymax = 0;
+  if (extent->heads > 0) {
+    xmin = extent->xmin < xmin ? extent->xmin : xmin;
+    xmax = extent->xmax > xmax ? extent->xmax : xmax;
+    ymin = extent->ymin < ymin ? extent->ymin : ymin;
+    ymax = extent->ymax > ymax ? extent->ymax : ymax;
+  }
+  canvas->x_origin = floor(xmin * zoom) - margin;
+  canvas->y_origin = floor(ymin * zoom) - margin;
+  canvas->width = ceil((xmax - xmin) * zoom) + margin * 2;
+  canvas->height = ceil((ymax - ymin) * zoom) + margin * 2;
+}
+
+struct wd_box wd_layout_to_canvas(const struct wd_layout_head *head,
+    double zoom, struct wd_point offset) {
+  struct wd_point size = wd_layout_size(head);
+  struct wd_box box;
+  box.x1 = floor(head->x * zoom - offset.x);
+  box.y1 = floor(head->y * zoom - offset.y);
+  box.x2 = floor(box.x1 + size.x * zoom);
+  box.y2 = floor(box.y1 + size.y * zoom);
+  return box;
+}
+
+struct wd_point wd_canvas_to_layout(struct wd_point point, double zoom,
+    struct wd_point offset) {
+  return (struct wd_point) {
+    .x = (point.x + offset.x) / zoom,
+    .y = (point.y + offset.y) / zoom,
+  };
+}
+
+struct wd_point wd_layout_snap(struct wd_point tl, struct wd_point size,
+    const struct wd_box *others, size_t n_others, double dist) {
+  const struct wd_point br = { /* bottom right */
+    .x = tl.x + size.x,
+    .y = tl.y + size.y
+  };
+  struct wd_point new_pos = tl;
+  for (size_t i = 0; i < n_others; i++) {
+    double x1 = others[i].x1;
+    double y1 = others[i].y1;
+    double x2 = others[i].x2;
+    double y2 = others[i].y2;
+    if (fabs(br.x) <= dist)
+      new_pos.x = -size.x;
+    if (fabs(br.y) <= dist)
+      new_pos.y = -size.y;
+    if (fabs(br.x - x1) <= dist)
+      new_pos.x = x1 - size.x;
+    if (fabs(br.x - x2) <= dist)
+      new_pos.x = x2 - size.x;
+    if (fabs(br.y - y1) <= dist)
+      new_pos.y = y1 - size.y;
+    if (fabs(br.y - y2) <= dist)
+      new_pos.y = y2 - size.y;
+
+    if (fabs(tl.x) <= dist)
+      new_pos.x = 0.;
+    if (fabs(tl.y) <= dist)
+      new_pos.y = 0.;
+    if (fabs(tl.x - x1) <= dist)
+      new_pos.x = x1;
+    if (fabs(tl.x - x2) <= dist)
+      new_pos.x = x2;
+    if (fabs(tl.y - y1) <= dist)
+      new_pos.y = y1;
+    if (fabs(tl.y - y2) <= dist)
+      new_pos.y = y2;
+  }
+  return new_pos;
+}
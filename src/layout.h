@@ -0,0 +1,117 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Geometry of the display layout and the canvas that shows it. Nothing here
+ * depends on GTK or Wayland.
+ */
+
+#ifndef WDISPLAY_LAYOUT_H
+#define WDISPLAY_LAYOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct wd_point {
+  double x;
+  double y;
+};
+
+struct wd_rect {
+  int x1, y1, x2, y2;
+};
+
+struct wd_box {
+  double x1, y1, x2, y2;
+};
+
+/*
+ * A head as placed in the layout: its position in the global space, and its
+ * mode before scaling and rotation.
+ */
+struct wd_layout_head {
+  double x, y;
+  double width, height; // px
+  double scale;
+  int rotation; // quarter turns
+};
+
+/*
+ * Bounds of the heads shown on the canvas, along with how many heads touch
+ * each edge. Removing a head only rescans when it was the last one on an edge.
+ */
+struct wd_canvas_extent {
+  int xmin, ymin, xmax, ymax;
+  unsigned xmin_count, ymin_count, xmax_count, ymax_count;
+  unsigned heads;
+  bool stale;
+};
+
+struct wd_canvas_geometry {
+  int x_origin;
+  int y_origin;
+  unsigned width;
+  unsigned height;
+};
+
+/*
+ * Size of the head in the global space, after scale and rotation.
+ */
+struct wd_point wd_layout_size(const struct wd_layout_head *head);
+
+/*
+ * Bounds of the head in the global space.
+ */
+struct wd_box wd_layout_box(const struct wd_layout_head *head);
+
+/*
+ * Bounds of the head in the global space, truncated to whole units.
+ */
+struct wd_rect wd_layout_rect(const struct wd_layout_head *head);
+
+bool wd_rect_equal(const struct wd_rect *a, const struct wd_rect *b);
+
+void wd_extent_add(struct wd_canvas_extent *extent, const struct wd_rect *rect);
+
+/*
+ * Removes a rectangle that was added before. Marks the extent stale when an
+ * edge lost its last rectangle; it must then be rebuilt from the remaining
+ * rectangles.
+ */
+void wd_extent_remove(struct wd_canvas_extent *extent,
+    const struct wd_rect *rect);
+
+/*
+ * Computes the scrollable canvas for the extent, which always includes the
+ * origin of the global space.
+ */
+void wd_layout_canvas(const struct wd_canvas_extent *extent, double zoom,
+    int margin, struct wd_canvas_geometry *canvas);
+
+/*
+ * Maps the head onto the canvas. The offset is the scroll position plus the
+ * canvas origin.
+ */
+struct wd_box wd_layout_to_canvas(const struct wd_layout_head *head,
+    double zoom, struct wd_point offset);
+
+/*
+ * Maps a canvas position back into the global space.
+ */
+struct wd_point wd_canvas_to_layout(struct wd_point point, double zoom,
+    struct wd_point offset);
+
+static inline bool wd_box_contains(const struct wd_box *box,
+    double x, double y) {
+  return x >= box->x1 && x < box->x2 && y >= box->y1 && y < box->y2;
+}
+
+/*
+ * Snaps a head of the given size at top left position tl to the edges of the
+ * other heads and to the axes, when they are within dist. Without other heads
+ * nothing snaps.
+ */
+struct wd_point wd_layout_snap(struct wd_point tl, struct wd_point size,
+    const struct wd_box *others, size_t n_others, double dist);
+
+#endif
@@ -1,6 +1,9 @@
 /* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
  * SPDX-License-Identifier: GPL-3.0-or-later */
 
+#include <inttypes.h>
+#include <time.h>
+
 #include <gtk/gtk.h>
 #include <gdk/gdkwayland.h>
 
@@ -20,22 +23,73 @@ __attribute__((noreturn)) void wd_fatal_error(int status, const char *message) {
 #define MIN_ZOOM (1./1000.)
 #define MAX_ZOOM 1000.
 #define CANVAS_MARGIN 40
+#define TEST_DEBOUNCE_MSECS 200
+#define HUD_UPDATE_MSECS 500
 
 static const char *APP_PREFIX = "app";
 
+static gint64 startup_begin;
+static gchar *record_path;
+static gchar *replay_path;
+static gchar *metrics_path;
+static gint memory_budget_mib;
+static gchar *apply_path;
+static gboolean dry_run;
+static gboolean test_only;
+static gboolean dump;
+static gboolean watch;
+#ifdef WDISPLAYS_PROFILING
+static gchar *profile_path;
+#endif
+
+static const GOptionEntry options[] = {
+  { "record", 0, 0, G_OPTION_ARG_FILENAME, &record_path,
+    "Record the protocol events received to FILE", "FILE" },
+  { "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_path,
+    "Replay a recording without a compositor and report its cost", "FILE" },
+  { "metrics", 0, 0, G_OPTION_ARG_FILENAME, &metrics_path,
+    "Write apply and capture metrics to FILE for Prometheus", "FILE" },
+  { "apply", 0, 0, G_OPTION_ARG_FILENAME, &apply_path,
+    "Apply the layout in FILE without opening a window, then exit", "FILE" },
+  { "dry-run", 0, 0, G_OPTION_ARG_NONE, &dry_run,
+    "With --apply, print the configuration instead of sending it", NULL },
+  { "test", 0, 0, G_OPTION_ARG_NONE, &test_only,
+    "With --apply, only ask the compositor whether it accepts the layout", NULL },
+  { "dump", 0, 0, G_OPTION_ARG_NONE, &dump,
+    "Print the outputs as JSON and exit", NULL },
+  { "watch", 0, 0, G_OPTION_ARG_NONE, &watch,
+    "Print a JSON line with the changes to the outputs as they happen", NULL },
+  { "memory-budget", 0, 0, G_OPTION_ARG_INT, &memory_budget_mib,
+    "Release previews of screens out of view to stay within MIB; previews "
+    "in view are always kept", "MIB" },
+#ifdef WDISPLAYS_PROFILING
+  { "profile", 0, 0, G_OPTION_ARG_FILENAME, &profile_path,
+    "Write timing spans to FILE in the Chrome trace event format", "FILE" },
+#endif
+  { NULL }
+};
+
 static bool has_changes(const struct wd_state *state) {
-  g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    if (wd_head_form_has_changes(WD_HEAD_FORM(form_iter->data),
-          g_object_get_data(G_OBJECT(form_iter->data), "head")))
-      return true;
+  return state->changed_heads > 0;
+}
+
+/*
+ * Compares one form against its head and keeps changed_heads in step, so
+ * has_changes never has to visit the other forms.
+ */
+static void update_head_changed(struct wd_state *state, struct wd_head *head) {
+  bool changed = head->form != NULL
+    && wd_head_form_has_changes(WD_HEAD_FORM(head->form), head);
+  if (changed != head->changed) {
+    head->changed = changed;
+    if (changed)
+      state->changed_heads++;
+    else
+      state->changed_heads--;
   }
-  return false;
 }
 
-static gboolean send_apply(gpointer data) {
-  struct wd_state *state = data;
-  state->apply_idle = -1;
+static struct wl_list *collect_head_configs(struct wd_state *state) {
   struct wl_list *outputs = calloc(1, sizeof(*outputs));
   wl_list_init(outputs);
   g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
@@ -45,14 +99,65 @@ static gboolean send_apply(gpointer data) {
     output->head = g_object_get_data(G_OBJECT(form_iter->data), "head");
     wd_head_form_fill_config(WD_HEAD_FORM(form_iter->data), output);
   }
+  return outputs;
+}
+
+static struct wl_display *get_wl_display(struct wd_state *state) {
   GdkWindow *window = gtk_widget_get_window(state->stack);
   GdkDisplay *display = gdk_window_get_display(window);
-  struct wl_display *wl_display = gdk_wayland_display_get_wl_display(display);
-  wd_apply_state(state, outputs, wl_display);
+  return gdk_wayland_display_get_wl_display(display);
+}
+
+static gboolean send_apply(gpointer data) {
+  WD_SPAN("send_apply");
+  struct wd_state *state = data;
+  state->apply_idle = -1;
+  if (state->apply_inflight) {
+    /* only one configuration can be in flight, send the latest form values
+     * once the compositor has answered */
+    state->apply_queued = TRUE;
+    state->apply_pending = FALSE;
+    return FALSE;
+  }
+  wd_apply_state(state, collect_head_configs(state), get_wl_display(state));
   state->apply_pending = FALSE;
   return FALSE;
 }
 
+static gboolean send_test(gpointer data) {
+  struct wd_state *state = data;
+  state->test_timeout = -1;
+  wd_test_state(state, collect_head_configs(state), get_wl_display(state));
+  return FALSE;
+}
+
+static void set_test_result(struct wd_state *state, bool valid) {
+  gtk_label_set_text(GTK_LABEL(state->apply_title),
+      valid ? "Apply Changes?" : "Changes Rejected by Display Server");
+  gtk_widget_set_sensitive(state->apply_button, valid);
+}
+
+/*
+ * Validates the forms with the compositor once the user stops editing.
+ * Restarting the timer drops the pending test, and bumping the serial in
+ * wd_test_state makes the results of any test still in flight stale.
+ */
+static void queue_test(struct wd_state *state) {
+  if (state->test_timeout != -1)
+    g_source_remove(state->test_timeout);
+  state->test_timeout = g_timeout_add(TEST_DEBOUNCE_MSECS, send_test, state);
+  set_test_result(state, TRUE);
+}
+
+static void cancel_test(struct wd_state *state) {
+  if (state->test_timeout != -1) {
+    g_source_remove(state->test_timeout);
+    state->test_timeout = -1;
+  }
+  state->test_serial++;
+  set_test_result(state, TRUE);
+}
+
 static void apply_state(struct wd_state *state) {
   gtk_stack_set_visible_child_name(GTK_STACK(state->header_stack), "title");
   if (!state->autoapply) {
@@ -105,40 +210,75 @@ static void update_scroll_size(struct wd_state *state) {
   gtk_adjustment_set_value(scroll_y_adj, MIN(y, scroll_y_upper));
 }
 
+static void get_form_layout(WdHeadForm *form, struct wd_layout_head *layout) {
+  WdHeadDimensions dim;
+  wd_head_form_get_dimensions(form, &dim);
+  layout->x = dim.x;
+  layout->y = dim.y;
+  layout->width = dim.w;
+  layout->height = dim.h;
+  layout->scale = dim.scale;
+  layout->rotation = dim.rotation_id;
+}
+
+static void extent_rescan(struct wd_state *state) {
+  struct wd_canvas_extent *extent = &state->canvas_extent;
+  *extent = (struct wd_canvas_extent) {0};
+  struct wd_head *head;
+  wl_list_for_each(head, &state->heads, link) {
+    if (head->in_canvas) {
+      wd_extent_add(extent, &head->canvas_rect);
+    }
+  }
+}
+
+static void remove_head_extent(struct wd_state *state, struct wd_head *head) {
+  if (head->in_canvas) {
+    head->in_canvas = false;
+    wd_extent_remove(&state->canvas_extent, &head->canvas_rect);
+  }
+}
+
+/*
+ * Moves a head's rectangle in the canvas extent to match its form.
+ */
+static void update_head_extent(struct wd_state *state, struct wd_head *head) {
+  if (head->form == NULL || !wd_head_form_get_enabled(WD_HEAD_FORM(head->form))) {
+    remove_head_extent(state, head);
+    return;
+  }
+  struct wd_layout_head layout;
+  get_form_layout(WD_HEAD_FORM(head->form), &layout);
+  struct wd_rect rect = wd_layout_rect(&layout);
+  if (head->in_canvas && wd_rect_equal(&rect, &head->canvas_rect)) {
+    return;
+  }
+  remove_head_extent(state, head);
+  head->canvas_rect = rect;
+  head->in_canvas = true;
+  wd_extent_add(&state->canvas_extent, &rect);
+}
+
 /*
  * Recalculates the desired canvas size, accounting for zoom + margins.
  */
 static void update_canvas_size(struct wd_state *state) {
-  int xmin = 0;
-  int xmax = 0;
-  int ymin = 0;
-  int ymax = 0;
-
-  g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    WdHeadForm *form = WD_HEAD_FORM(form_iter->data);
-    if (wd_head_form_get_enabled(form)) {
-      WdHeadDimensions dim;
-      wd_head_form_get_dimensions(form, &dim);
-      int h = dim.h;
-      int w = dim.w;
-      int x2 = dim.x + w;
-      int y2 = dim.x + h;
-      if (dim.scale > 0.) {
-        w /= dim.scale;
-        h /= dim.scale;
-      }
-      xmin = MIN(xmin, dim.x);
-      xmax = MAX(xmax, x2);
-      ymin = MIN(ymin, dim.y);
-      ymax = MAX(ymax, y2);
-    }
+  if (state->canvas_extent.stale) {
+    extent_rescan(state);
+  }
+  struct wd_canvas_geometry canvas;
+  wd_layout_canvas(&state->canvas_extent, state->zoom, CANVAS_MARGIN, &canvas);
+  if (canvas.x_origin == state->render.x_origin
+      && canvas.y_origin == state->render.y_origin
+      && canvas.width == state->render.width
+      && canvas.height == state->render.height) {
+    return;
   }
   // update canvas sizings
-  state->render.x_origin = floor(xmin * state->zoom) - CANVAS_MARGIN;
-  state->render.y_origin = floor(ymin * state->zoom) - CANVAS_MARGIN;
-  state->render.width = ceil((xmax - xmin) * state->zoom) + CANVAS_MARGIN * 2;
-  state->render.height = ceil((ymax - ymin) * state->zoom) + CANVAS_MARGIN * 2;
+  state->render.x_origin = canvas.x_origin;
+  state->render.y_origin = canvas.y_origin;
+  state->render.width = canvas.width;
+  state->render.height = canvas.height;
 
   update_scroll_size(state);
 }
@@ -206,6 +346,14 @@ static inline void flip_anim(uint64_t *timer, uint64_t tick) {
   }
 }
 
+static inline bool render_contains(const struct wd_render_head_data *render,
+    double x, double y) {
+  const struct wd_box box = {
+    .x1 = render->x1, .y1 = render->y1, .x2 = render->x2, .y2 = render->y2,
+  };
+  return wd_box_contains(&box, x, y);
+}
+
 static void update_hovered(struct wd_state *state,
     gdouble mouse_x, gdouble mouse_y) {
   if (!gtk_widget_get_realized(state->canvas)) {
@@ -225,8 +373,7 @@ static void update_hovered(struct wd_state *state,
       render->hovered = TRUE;
       any_hovered = TRUE;
     } else if (state->clicked == NULL) {
-      if (mouse_x >= render->x1 && mouse_x < render->x2 &&
-          mouse_y >= render->y1 && mouse_y < render->y2) {
+      if (render_contains(render, mouse_x, mouse_y)) {
         render->hovered = TRUE;
         any_hovered = TRUE;
       }
@@ -249,8 +396,47 @@ static inline void color_to_float_array(GtkStyleContext *ctx,
   out[3] = color.alpha;
 }
 
-#define SWAP(_type, _a, _b) { _type _tmp = (_a); (_a) = (_b); (_b) = _tmp; }
+static inline struct wd_point canvas_offset(const struct wd_state *state) {
+  return (struct wd_point) {
+    .x = state->render.scroll_x + state->render.x_origin,
+    .y = state->render.scroll_y + state->render.y_origin,
+  };
+}
 
+/*
+ * Places a head's box on the canvas from its form.
+ */
+static void update_head_render(struct wd_state *state, struct wd_head *head) {
+  if (head->form == NULL || !wd_head_form_get_enabled(WD_HEAD_FORM(head->form))) {
+    return;
+  }
+  WdHeadForm *form = WD_HEAD_FORM(head->form);
+  WdHeadDimensions dim;
+  wd_head_form_get_dimensions(form, &dim);
+  struct wd_layout_head layout;
+  get_form_layout(form, &layout);
+  if (layout.scale <= 0.)
+    layout.scale = 1.;
+
+  if (head->render == NULL) {
+    head->render = calloc(1, sizeof(*head->render));
+    wl_list_insert(&state->render.heads, &head->render->link);
+  }
+  struct wd_render_head_data *render = head->render;
+  render->queued.rotation = dim.rotation_id;
+  render->queued.x_invert = dim.flipped;
+  struct wd_box box = wd_layout_to_canvas(&layout, state->zoom,
+      state->drawn_offset);
+  render->x1 = box.x1;
+  render->y1 = box.y1;
+  render->x2 = box.x2;
+  render->y2 = box.y2;
+}
+
+/*
+ * Heads that change are placed again as their forms signal, so only a scroll
+ * or zoom has to move every box.
+ */
 static void queue_canvas_draw(struct wd_state *state) {
   GtkStyleContext *style_ctx = gtk_widget_get_style_context(state->canvas);
   color_to_float_array(style_ctx,
@@ -264,33 +450,14 @@ static void queue_canvas_draw(struct wd_state *state) {
 
   cache_scroll(state);
 
-  g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    WdHeadForm *form = WD_HEAD_FORM(form_iter->data);
-    if (wd_head_form_get_enabled(form)) {
-      WdHeadDimensions dim;
-      wd_head_form_get_dimensions(form, &dim);
-      double w = dim.w;
-      double h = dim.h;
-      double scale = dim.scale;
-      if (scale <= 0.)
-        scale = 1.;
-
-      struct wd_head *head = g_object_get_data(G_OBJECT(form_iter->data), "head");
-      if (head->render == NULL) {
-        head->render = calloc(1, sizeof(*head->render));
-        wl_list_insert(&state->render.heads, &head->render->link);
-      }
-      struct wd_render_head_data *render = head->render;
-      render->queued.rotation = dim.rotation_id;
-      if (render->queued.rotation & 1) {
-        SWAP(int, w, h);
-      }
-      render->queued.x_invert = dim.flipped;
-      render->x1 = floor(dim.x * state->zoom - state->render.scroll_x - state->render.x_origin);
-      render->y1 = floor(dim.y * state->zoom - state->render.scroll_y - state->render.y_origin);
-      render->x2 = floor(render->x1 + w * state->zoom / scale);
-      render->y2 = floor(render->y1 + h * state->zoom / scale);
+  struct wd_point offset = canvas_offset(state);
+  if (offset.x != state->drawn_offset.x || offset.y != state->drawn_offset.y
+      || state->zoom != state->drawn_zoom) {
+    state->drawn_offset = offset;
+    state->drawn_zoom = state->zoom;
+    struct wd_head *head;
+    wl_list_for_each(head, &state->heads, link) {
+      update_head_render(state, head);
     }
   }
   gtk_gl_area_queue_render(GTK_GL_AREA(state->canvas));
@@ -299,79 +466,129 @@ static void queue_canvas_draw(struct wd_state *state) {
 static void show_apply(struct wd_state *state) {
   const gchar *page = "title";
   if (has_changes(state)) {
-    if (state->autoapply) {
-      apply_state(state);
-    } else {
+    /* auto-apply waits for the test so rejected layouts are never sent */
+    queue_test(state);
+    if (!state->autoapply) {
       page = "apply";
     }
+  } else {
+    cancel_test(state);
   }
   gtk_stack_set_visible_child_name(GTK_STACK(state->header_stack), page);
 }
 
-static void update_ui(WdHeadForm *form, enum wd_head_fields fields,
-    gpointer data) {
+/*
+ * Brings the extent, canvas size, apply button and canvas geometry up to date
+ * with every form that changed since the last pass. Each of those walks all
+ * heads, so they run once per main loop iteration rather than once per form
+ * signal.
+ */
+static gboolean update_ui_idle(gpointer data) {
+  WD_SPAN("update_ui");
   struct wd_state *state = data;
+  state->ui_idle = -1;
+  bool resized = false;
+  struct wd_head *head;
+  wl_list_for_each(head, &state->heads, link) {
+    if (head->ui_dirty & (WD_FIELD_ENABLED | WD_FIELD_MODE | WD_FIELD_POSITION
+          | WD_FIELD_TRANSFORM | WD_FIELD_SCALE)) {
+      update_head_extent(state, head);
+      update_head_render(state, head);
+      resized = true;
+    }
+    head->ui_dirty = 0;
+  }
+  if (resized) {
+    update_canvas_size(state);
+  }
   show_apply(state);
-  update_canvas_size(state);
   queue_canvas_draw(state);
+  return FALSE;
+}
+
+static void queue_update_ui(struct wd_state *state, struct wd_head *head,
+    enum wd_head_fields fields) {
+  head->ui_dirty |= fields;
+  update_head_changed(state, head);
+  if (state->ui_idle == -1) {
+    /* ahead of GTK's layout and paint, so the frame shows the change */
+    state->ui_idle = g_idle_add_full(G_PRIORITY_HIGH_IDLE,
+        update_ui_idle, state, NULL);
+  }
+}
+
+static void update_ui(WdHeadForm *form, enum wd_head_fields fields,
+    gpointer data) {
+  queue_update_ui(data, g_object_get_data(G_OBJECT(form), "head"), fields);
 }
 
 void wd_ui_reset_heads(struct wd_state *state) {
+  WD_SPAN("wd_ui_reset_heads");
   if (state->stack == NULL) {
     return;
   }
 
-  g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-  GList *form_iter = forms;
   struct wd_head *head;
   int i = 0;
   wl_list_for_each(head, &state->heads, link) {
-    if (form_iter == NULL) {
-      GtkWidget *form = wd_head_form_new();;
+    if (head->form == NULL) {
+      GtkWidget *form = wd_head_form_new();
+      head->form = form;
       g_object_set_data(G_OBJECT(form), "head", head);
       g_signal_connect(form, "changed", G_CALLBACK(update_ui), state);
-      g_autofree gchar *page_name = g_strdup_printf("%d", i);
+      g_autofree gchar *page_name = g_strdup_printf("%u", head->id);
       gtk_stack_add_titled(GTK_STACK(state->stack), form, page_name, head->name);
+      gtk_container_child_set(GTK_CONTAINER(state->stack), form, "position", i, NULL);
       wd_head_form_update(WD_HEAD_FORM(form), head, WD_FIELDS_ALL);
-    } else {
-      GtkWidget *form = GTK_WIDGET(form_iter->data);
-      if (head != g_object_get_data(G_OBJECT(form), "head")) {
-        g_object_set_data(G_OBJECT(form), "head", head);
-        gtk_container_child_set(GTK_CONTAINER(state->stack), form, "title", head->name, NULL);
-        wd_head_form_update(WD_HEAD_FORM(form), head, WD_FIELDS_ALL);
-      }
-      form_iter = form_iter->next;
+      update_head_extent(state, head);
+      update_head_render(state, head);
+      update_head_changed(state, head);
+    } else if (head->dirty) {
+      if (head->dirty & WD_FIELD_NAME)
+        gtk_container_child_set(GTK_CONTAINER(state->stack), head->form, "title", head->name, NULL);
+      wd_head_form_update(WD_HEAD_FORM(head->form), head, head->dirty);
+      update_head_extent(state, head);
+      update_head_render(state, head);
+      update_head_changed(state, head);
     }
     i++;
   }
-  // remove everything else
-  for (; form_iter != NULL; form_iter = form_iter->next) {
-    gtk_container_remove(GTK_CONTAINER(state->stack), GTK_WIDGET(form_iter->data));
-  }
   update_canvas_size(state);
   queue_canvas_draw(state);
 }
 
-void wd_ui_reset_head(const struct wd_head *head, enum wd_head_fields fields) {
-  if (head->state->stack == NULL) {
+void wd_ui_reset_head(struct wd_head *head, enum wd_head_fields fields) {
+  WD_SPAN("wd_ui_reset_head");
+  if (head->form == NULL) {
     return;
   }
-  g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(head->state->stack));
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    GtkWidget *form = GTK_WIDGET(form_iter->data);
-    const struct wd_head *other = g_object_get_data(G_OBJECT(form), "head");
-    if (head == other) {
-      if (fields & WD_FIELD_NAME)
-        gtk_container_child_set(GTK_CONTAINER(head->state->stack), form, "title", head->name, NULL);
-      wd_head_form_update(WD_HEAD_FORM(form), head, fields);
-      break;
-    }
+  if (fields & WD_FIELD_NAME)
+    gtk_container_child_set(GTK_CONTAINER(head->state->stack), head->form, "title", head->name, NULL);
+  wd_head_form_update(WD_HEAD_FORM(head->form), head, fields);
+  queue_update_ui(head->state, head, fields);
+}
+
+static size_t surface_bytes(cairo_surface_t *surface) {
+  return (size_t) cairo_image_surface_get_stride(surface)
+    * cairo_image_surface_get_height(surface);
+}
+
+void wd_ui_remove_head(struct wd_head *head) {
+  if (head->form != NULL) {
+    gtk_container_remove(GTK_CONTAINER(head->state->stack), head->form);
+    head->form = NULL;
   }
-  update_canvas_size(head->state);
-  queue_canvas_draw(head->state);
+  update_head_changed(head->state, head);
+  if (head->surface != NULL) {
+    head->state->memory.bytes[WD_MEMORY_LABELS] -= surface_bytes(head->surface);
+    cairo_surface_destroy(head->surface);
+    head->surface = NULL;
+  }
+  remove_head_extent(head->state, head);
 }
 
 void wd_ui_reset_all(struct wd_state *state) {
+  WD_SPAN("wd_ui_reset_all");
   wd_ui_reset_heads(state);
   g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
   for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
@@ -379,12 +596,20 @@ void wd_ui_reset_all(struct wd_state *state) {
     struct wd_head *head = g_object_get_data(G_OBJECT(form), "head");
     gtk_container_child_set(GTK_CONTAINER(state->stack), form, "title", head->name, NULL);
     wd_head_form_update(WD_HEAD_FORM(form_iter->data), head, WD_FIELDS_ALL);
+    update_head_extent(state, head);
+    update_head_render(state, head);
+    update_head_changed(state, head);
   }
   update_canvas_size(state);
   queue_canvas_draw(state);
 }
 
 void wd_ui_apply_done(struct wd_state *state, struct wl_list *outputs) {
+  g_debug("apply %s after %.1fms", outputs != NULL ? "succeeded" : "failed",
+      state->apply_latency / 1000.);
+  if (state->stack == NULL) {
+    return;
+  }
   gtk_style_context_remove_class(gtk_widget_get_style_context(state->spinner), "visible");
   gtk_overlay_set_overlay_pass_through(GTK_OVERLAY(state->overlay), state->spinner, TRUE);
   gtk_spinner_stop(GTK_SPINNER(state->spinner));
@@ -398,11 +623,51 @@ void wd_ui_apply_done(struct wd_state *state, struct wl_list *outputs) {
   if (!state->autoapply) {
     show_apply(state);
   }
-  state->reset_idle = g_idle_add_full(G_PRIORITY_DEFAULT,
-      apply_done_reset, state, NULL);
+  if (state->apply_queued) {
+    state->apply_queued = FALSE;
+    apply_state(state);
+    return;
+  }
+  if (state->reset_idle == -1) {
+    state->reset_idle = g_idle_add_full(G_PRIORITY_DEFAULT,
+        apply_done_reset, state, NULL);
+  }
+}
+
+void wd_ui_test_done(struct wd_state *state, bool succeeded) {
+  if (state->stack == NULL) {
+    return;
+  }
+  if (state->test_timeout != -1) {
+    /* the forms changed again since this test was sent */
+    return;
+  }
+  set_test_result(state, succeeded);
+  if (succeeded && state->autoapply && has_changes(state)) {
+    apply_state(state);
+  }
+}
+
+void wd_ui_test_cancelled(struct wd_state *state) {
+  if (state->stack == NULL) {
+    return;
+  }
+  if (state->test_timeout != -1) {
+    /* a newer test is queued already */
+    return;
+  }
+  if (has_changes(state)) {
+    send_test(state);
+  } else {
+    set_test_result(state, TRUE);
+  }
 }
 
 void wd_ui_show_error(struct wd_state *state, const char *message) {
+  if (state->stack == NULL) {
+    fprintf(stderr, "%s\n", message);
+    return;
+  }
   gtk_label_set_text(GTK_LABEL(state->info_label), message);
   gtk_widget_show(state->info_bar);
   gtk_info_bar_set_revealed(GTK_INFO_BAR(state->info_bar), TRUE);
@@ -413,22 +678,30 @@ static void cleanup(GtkWidget *window, gpointer data) {
   struct wd_state *state = data;
   if (state->reset_idle != -1)
     g_source_remove(state->reset_idle);
+  if (state->ui_idle != -1)
+    g_source_remove(state->ui_idle);
   if (state->apply_idle != -1)
     g_source_remove(state->apply_idle);
+  if (state->test_timeout != -1)
+    g_source_remove(state->test_timeout);
+  if (state->hud_timeout != -1)
+    g_source_remove(state->hud_timeout);
   g_object_unref(state->grab_cursor);
   g_object_unref(state->grabbing_cursor);
   g_object_unref(state->move_cursor);
+  g_clear_object(&state->overlay_style);
+  g_clear_object(&state->overlay_pango);
+  wd_metrics_stop(state);
   wd_state_destroy(state);
+  wd_trace_stop();
 }
 
 static void monitor_added(GdkDisplay *display, GdkMonitor *monitor, gpointer data) {
-  struct wl_display *wl_display = gdk_wayland_display_get_wl_display(display);
-  wd_add_output(data, gdk_wayland_monitor_get_wl_output(monitor), wl_display);
+  wd_add_output(data, gdk_wayland_monitor_get_wl_output(monitor));
 }
 
 static void monitor_removed(GdkDisplay *display, GdkMonitor *monitor, gpointer data) {
-  struct wl_display *wl_display = gdk_wayland_display_get_wl_display(display);
-  wd_remove_output(data, gdk_wayland_monitor_get_wl_output(monitor), wl_display);
+  wd_remove_output(data, gdk_wayland_monitor_get_wl_output(monitor));
 }
 
 static void canvas_realize(GtkWidget *widget, gpointer data) {
@@ -487,6 +760,7 @@ static void zoom_in(GSimpleAction *action, GVariant *param, gpointer data) {
 static cairo_surface_t *draw_head(PangoContext *pango,
     struct wd_render_data *info, const char *name,
     unsigned width, unsigned height) {
+  WD_SPAN("draw_head");
   cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
       width, height);
   cairo_t *cr = cairo_create(surface);
@@ -516,8 +790,73 @@ static cairo_surface_t *draw_head(PangoContext *pango,
   return surface;
 }
 
+static bool head_visible(const struct wd_render_data *info,
+    const struct wd_render_head_data *render) {
+  return render->x2 > 0 && render->y2 > 0
+    && render->x1 < info->viewport_width && render->y1 < info->viewport_height;
+}
+
+/*
+ * Releases the previews of outputs that are off the canvas, least recently
+ * viewed first, until the held memory fits the budget. Visible previews are
+ * kept, so when they alone exceed the budget it is reported once and left
+ * exceeded.
+ */
+static void enforce_memory_budget(struct wd_state *state, uint64_t tick) {
+  struct wd_memory *memory = &state->memory;
+  if (memory->budget == 0)
+    return;
+  size_t releasing = 0; // texture storage replaced on the next render
+  for (;;) {
+    size_t total = 0;
+    for (int i = 0; i < WD_MEMORY_CATEGORIES; i++)
+      total += memory->bytes[i];
+    if (total - releasing <= memory->budget) {
+      memory->over_budget = false;
+      return;
+    }
+
+    struct wd_output *victim = NULL;
+    struct wd_output *output;
+    wl_list_for_each(output, &state->outputs, link) {
+      if (output->viewed_at != tick && !wl_list_empty(&output->frames)
+          && (victim == NULL || output->viewed_at < victim->viewed_at))
+        victim = output;
+    }
+    if (victim == NULL) {
+      if (!memory->over_budget) {
+        fprintf(stderr, "The previews in view need %.1f MiB, over the "
+            "memory budget of %.1f MiB\n", (total - releasing) / 1048576.,
+            memory->budget / 1048576.);
+        memory->over_budget = true;
+      }
+      return;
+    }
+
+    struct wd_head *head = wd_find_head(state, victim);
+    if (head != NULL && head->render != NULL && head->render->preview) {
+      /* it points into the frame; the next render draws the label in its
+       * place, which replaces the preview's texture storage in GL */
+      head->render->pixels = NULL;
+      releasing += wd_gl_texture_bytes(head->render->tex_width,
+          head->render->tex_height);
+      gtk_gl_area_queue_render(GTK_GL_AREA(state->canvas));
+    }
+    wd_output_release_preview(victim);
+  }
+}
+
+/* time spent on the GTK thread, without waits for the GPU or the scheduler */
+static uint64_t thread_cpu_usecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void canvas_render(GtkGLArea *area, GdkGLContext *context, gpointer data) {
+  WD_SPAN("canvas_render");
   struct wd_state *state = data;
+  uint64_t start = thread_cpu_usecs();
 
   PangoContext *pango = gtk_widget_get_pango_context(state->canvas);
   GdkFrameClock *clock = gtk_widget_get_frame_clock(state->canvas);
@@ -530,6 +869,10 @@ static void canvas_render(GtkGLArea *area, GdkGLContext *context, gpointer data)
     struct wd_render_head_data *render = head->render;
     struct wd_output *output = wd_find_output(state, head);
     struct wd_frame *frame = NULL;
+    if (output != NULL && render != NULL && head_visible(&state->render, render)) {
+      output->viewed_at = tick;
+      output->preview_released = false;
+    }
     if (output != NULL && !wl_list_empty(&output->frames)) {
       frame = wl_container_of(output->frames.prev, frame, link);
     }
@@ -555,10 +898,12 @@ static void canvas_render(GtkGLArea *area, GdkGLContext *context, gpointer data)
         render->tex_height = render->y2 - render->y1;
         render->preview = FALSE;
         if (head->surface != NULL) {
+          state->memory.bytes[WD_MEMORY_LABELS] -= surface_bytes(head->surface);
           cairo_surface_destroy(head->surface);
         }
         head->surface = draw_head(pango, &state->render, head->name,
             render->tex_width, render->tex_height);
+        state->memory.bytes[WD_MEMORY_LABELS] += surface_bytes(head->surface);
         render->pixels = cairo_image_surface_get_data(head->surface);
         render->tex_stride = cairo_image_surface_get_stride(head->surface);
         render->updated_at = tick;
@@ -570,8 +915,31 @@ static void canvas_render(GtkGLArea *area, GdkGLContext *context, gpointer data)
     }
   }
 
+  struct wd_render_stats *stats = &state->render.stats;
+  int64_t refresh = 0;
+  gdk_frame_clock_get_refresh_info(clock, tick, &refresh, NULL);
+  if (state->capture && stats->last_tick != 0 && refresh > 0) {
+    int64_t interval = tick - stats->last_tick;
+    if (interval > refresh * 3 / 2)
+      stats->skipped_frames += (interval + refresh / 2) / refresh - 1;
+  }
+  stats->last_tick = state->capture ? tick : 0;
+
   wd_gl_render(state->gl_data, &state->render, tick);
+  stats->frame_usecs[stats->frames % RENDER_STAT_SAMPLES] =
+    thread_cpu_usecs() - start;
+  if (++stats->frames % RENDER_STAT_SAMPLES == 0) {
+    g_debug("render: %" PRIu64 " frames, CPU p50 %" PRIu32 "us, p90 %" PRIu32
+        "us, p99 %" PRIu32 "us, %" PRIu64 " texture uploads, %" PRIu64
+        " bytes uploaded", stats->frames,
+        wd_render_stats_percentile(stats, .5),
+        wd_render_stats_percentile(stats, .9),
+        wd_render_stats_percentile(stats, .99),
+        stats->texture_uploads, stats->upload_bytes);
+  }
   state->render.updated_at = tick;
+  state->memory.bytes[WD_MEMORY_TEXTURES] = state->render.texture_bytes;
+  enforce_memory_budget(state, tick);
 }
 
 static void canvas_unrealize(GtkWidget *widget, gpointer data) {
@@ -580,13 +948,9 @@ static void canvas_unrealize(GtkWidget *widget, gpointer data) {
     return;
   }
   struct wd_state *state = data;
-
-  GdkDisplay *gdk_display = gdk_display_get_default();
-  struct wl_display *display = gdk_wayland_display_get_wl_display(gdk_display);
-  wd_capture_wait(state, display);
-
   wd_gl_cleanup(state->gl_data);
   state->gl_data = NULL;
+  state->render.texture_bytes = 0;
 }
 
 static void set_clicked_head(struct wd_state *state,
@@ -605,6 +969,10 @@ static void set_clicked_head(struct wd_state *state,
     update_tick_callback(state);
   }
   state->clicked = clicked;
+  if (clicked == NULL) {
+    state->drag_head = NULL;
+    g_clear_pointer(&state->snap_boxes, g_array_unref);
+  }
 }
 
 static void canvas_drag1_begin(GtkGestureDrag *drag,
@@ -614,8 +982,7 @@ static void canvas_drag1_begin(GtkGestureDrag *drag,
   struct wd_render_head_data *render;
   state->clicked = NULL;
   wl_list_for_each(render, &state->render.heads, link) {
-    if (mouse_x >= render->x1 && mouse_x < render->x2 &&
-        mouse_y >= render->y1 && mouse_y < render->y2) {
+    if (render_contains(render, mouse_x, mouse_y)) {
       set_clicked_head(state, render);
       state->drag_start.x = mouse_x;
       state->drag_start.y = mouse_y;
@@ -634,12 +1001,24 @@ static void canvas_drag1_begin(GtkGestureDrag *drag,
       render->preview = TRUE;
     }
     gtk_gl_area_queue_render(GTK_GL_AREA(state->canvas));
-    g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-    for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-      const struct wd_head *other = g_object_get_data(G_OBJECT(form_iter->data), "head");
-      if (state->clicked == other->render) {
-        gtk_stack_set_visible_child(GTK_STACK(state->stack), form_iter->data);
-        break;
+
+    /* the other heads can't move until the drag ends */
+    state->drag_head = NULL;
+    g_clear_pointer(&state->snap_boxes, g_array_unref);
+    state->snap_boxes = g_array_new(FALSE, FALSE, sizeof(struct wd_box));
+    struct wd_head *head;
+    wl_list_for_each(head, &state->heads, link) {
+      if (head->form == NULL) {
+        continue;
+      }
+      if (head->render == state->clicked) {
+        state->drag_head = head;
+        gtk_stack_set_visible_child(GTK_STACK(state->stack), head->form);
+      } else {
+        struct wd_layout_head layout;
+        get_form_layout(WD_HEAD_FORM(head->form), &layout);
+        struct wd_box box = wd_layout_box(&layout);
+        g_array_append_val(state->snap_boxes, box);
       }
     }
   }
@@ -651,93 +1030,27 @@ static void canvas_drag1_update(GtkGestureDrag *drag,
     gdouble delta_x, gdouble delta_y, gpointer data) {
   struct wd_state *state = data;
 
-  if (state->clicked == NULL)
-    return;
-  WdHeadForm *form = NULL;
-  g_autoptr(GList) forms = gtk_container_get_children(GTK_CONTAINER(state->stack));
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    const struct wd_head *other = g_object_get_data(G_OBJECT(form_iter->data), "head");
-    if (state->clicked == other->render) {
-      form = WD_HEAD_FORM(form_iter->data);
-      break;
-    }
-  }
-  if (!form)
+  if (state->drag_head == NULL)
     return;
-  WdHeadDimensions dim;
-  wd_head_form_get_dimensions(form, &dim);
-  struct wd_point size = { .x = dim.w, .y = dim.h };
-  if (dim.scale > 0.) {
-    size.x /= dim.scale;
-    size.y /= dim.scale;
-  }
-  if (dim.rotation_id & 1) {
-    SWAP(int, size.x, size.y);
-  }
-  struct wd_point tl = { /* top left */
-    .x = (state->drag_start.x + delta_x - state->head_drag_start.x * size.x * state->zoom
-        + state->render.x_origin + state->render.scroll_x) / state->zoom,
-    .y = (state->drag_start.y + delta_y - state->head_drag_start.y * size.y * state->zoom
-        + state->render.y_origin + state->render.scroll_y) / state->zoom
+  WdHeadForm *form = WD_HEAD_FORM(state->drag_head->form);
+  struct wd_layout_head layout;
+  get_form_layout(form, &layout);
+  struct wd_point size = wd_layout_size(&layout);
+  const struct wd_point grab = {
+    .x = state->drag_start.x + delta_x - state->head_drag_start.x * size.x * state->zoom,
+    .y = state->drag_start.y + delta_y - state->head_drag_start.y * size.y * state->zoom,
   };
-
-  const struct wd_point br = { /* bottom right */
-    .x = tl.x + size.x,
-    .y = tl.y + size.y
-  };
-  struct wd_point new_pos = tl;
-  float snap = SNAP_DIST / state->zoom;
+  struct wd_point tl = wd_canvas_to_layout(grab, state->zoom,
+      canvas_offset(state));
 
   GdkEvent *event = gtk_get_current_event();
   GdkModifierType mod_state = event->motion.state;
 
   /* snapping */
-  for (GList *form_iter = forms; form_iter != NULL; form_iter = form_iter->next) {
-    WdHeadForm *other_form = WD_HEAD_FORM(form_iter->data);
-    const struct wd_head *other = g_object_get_data(G_OBJECT(other_form), "head");
-    if (other->render != state->clicked && !(mod_state & GDK_SHIFT_MASK)) {
-      WdHeadDimensions other_dim;
-      wd_head_form_get_dimensions(other_form, &other_dim);
-      double x1 = other_dim.x;
-      double y1 = other_dim.y;
-      double w = other_dim.w;
-      double h = other_dim.h;
-      if (other_dim.scale > 0.) {
-        w /= other_dim.scale;
-        h /= other_dim.scale;
-      }
-      if (other_dim.rotation_id & 1) {
-        SWAP(int, w, h);
-      }
-      double x2 = x1 + w;
-      double y2 = y1 + h;
-      if (fabs(br.x) <= snap)
-        new_pos.x = -size.x;
-      if (fabs(br.y) <= snap)
-        new_pos.y = -size.y;
-      if (fabs(br.x - x1) <= snap)
-        new_pos.x = x1 - size.x;
-      if (fabs(br.x - x2) <= snap)
-        new_pos.x = x2 - size.x;
-      if (fabs(br.y - y1) <= snap)
-        new_pos.y = y1 - size.y;
-      if (fabs(br.y - y2) <= snap)
-        new_pos.y = y2 - size.y;
-
-      if (fabs(tl.x) <= snap)
-        new_pos.x = 0.;
-      if (fabs(tl.y) <= snap)
-        new_pos.y = 0.;
-      if (fabs(tl.x - x1) <= snap)
-        new_pos.x = x1;
-      if (fabs(tl.x - x2) <= snap)
-        new_pos.x = x2;
-      if (fabs(tl.y - y1) <= snap)
-        new_pos.y = y1;
-      if (fabs(tl.y - y2) <= snap)
-        new_pos.y = y2;
-    }
-  }
+  GArray *others = state->snap_boxes;
+  guint n_others = mod_state & GDK_SHIFT_MASK ? 0 : others->len;
+  struct wd_point new_pos = wd_layout_snap(tl, size,
+      (const struct wd_box *) others->data, n_others, SNAP_DIST / state->zoom);
   wd_head_form_set_position(form, new_pos.x, new_pos.y);
 }
 
@@ -879,6 +1192,80 @@ static void capture_selected(GSimpleAction *action, GVariant *param, gpointer da
   update_tick_callback(state);
 }
 
+static gboolean update_hud(gpointer data) {
+  struct wd_state *state = data;
+  struct wd_render_stats *stats = &state->render.stats;
+  uint64_t now = g_get_monotonic_time();
+  double secs = (now - state->hud_time) / 1000000.;
+
+  unsigned in_flight = 0;
+  struct wd_output *output;
+  wl_list_for_each(output, &state->outputs, link) {
+    struct wd_frame *frame;
+    wl_list_for_each(frame, &output->frames, link) {
+      if (frame->pixels == NULL)
+        in_flight++;
+    }
+  }
+
+  g_autoptr(GString) text = g_string_new(NULL);
+  g_string_append_printf(text, "%.1f fps\n",
+      secs > 0. ? (stats->frames - state->hud_frames) / secs : 0.);
+  g_string_append_printf(text, "render %.2f ms p50, %.2f ms p99 CPU\n",
+      wd_render_stats_percentile(stats, .5) / 1000.,
+      wd_render_stats_percentile(stats, .99) / 1000.);
+  g_string_append_printf(text, "upload %.1f KiB/s\n",
+      secs > 0. ? (stats->upload_bytes - state->hud_upload_bytes) / secs / 1024. : 0.);
+  g_string_append_printf(text, "skipped %" PRIu64 " frames\n",
+      stats->skipped_frames);
+  g_string_append_printf(text, "%u captures in flight\n", in_flight);
+  const struct wd_memory *memory = &state->memory;
+  g_string_append_printf(text, "memory %.1f MiB frames, %.1f MiB textures, "
+      "%.1f MiB labels, %.1f KiB arenas",
+      memory->bytes[WD_MEMORY_FRAMES] / 1048576.,
+      memory->bytes[WD_MEMORY_TEXTURES] / 1048576.,
+      memory->bytes[WD_MEMORY_LABELS] / 1048576.,
+      state->alloc_stats.block_bytes / 1024.);
+  if (memory->budget > 0) {
+    g_string_append_printf(text, "\nbudget %.1f MiB, %" PRIu64 " previews released",
+        memory->budget / 1048576., memory->releases);
+    if (memory->over_budget)
+      g_string_append(text, ", exceeded by the previews in view");
+  }
+  if (state->capture) {
+    wl_list_for_each(output, &state->outputs, link) {
+      g_string_append_printf(text, "\n%s capture %.1f ms",
+          output->name != NULL ? output->name : "?",
+          output->capture_latency / 1000.);
+    }
+  }
+  gtk_label_set_text(GTK_LABEL(state->hud), text->str);
+
+  state->hud_time = now;
+  state->hud_frames = stats->frames;
+  state->hud_upload_bytes = stats->upload_bytes;
+  return G_SOURCE_CONTINUE;
+}
+
+static void hud_selected(GSimpleAction *action, GVariant *param, gpointer data) {
+  struct wd_state *state = data;
+  state->show_hud = g_variant_get_boolean(param);
+  g_simple_action_set_state(action, param);
+
+  if (state->hud_timeout != -1) {
+    g_source_remove(state->hud_timeout);
+    state->hud_timeout = -1;
+  }
+  if (state->show_hud) {
+    state->hud_time = g_get_monotonic_time();
+    state->hud_frames = state->render.stats.frames;
+    state->hud_upload_bytes = state->render.stats.upload_bytes;
+    gtk_label_set_text(GTK_LABEL(state->hud), "");
+    state->hud_timeout = g_timeout_add(HUD_UPDATE_MSECS, update_hud, state);
+  }
+  gtk_widget_set_visible(state->hud, state->show_hud);
+}
+
 static void overlay_selected(GSimpleAction *action, GVariant *param, gpointer data) {
   struct wd_state *state = data;
   state->show_overlay = g_variant_get_boolean(param);
@@ -924,6 +1311,10 @@ static void activate(GtkApplication* app, gpointer user_data) {
   state->canvas_tick = -1;
   state->apply_idle = -1;
   state->reset_idle = -1;
+  state->ui_idle = -1;
+  state->test_timeout = -1;
+  state->hud_timeout = -1;
+  state->memory.budget = (size_t) MAX(memory_budget_mib, 0) * 1024 * 1024;
 
   GtkCssProvider *css_provider = gtk_css_provider_new();
   gtk_css_provider_load_from_resource(css_provider,
@@ -948,9 +1339,12 @@ static void activate(GtkApplication* app, gpointer user_data) {
   state->zoom_reset = GTK_WIDGET(gtk_builder_get_object(builder, "zoom_reset"));
   state->zoom_in = GTK_WIDGET(gtk_builder_get_object(builder, "zoom_in"));
   state->overlay = GTK_WIDGET(gtk_builder_get_object(builder, "overlay"));
+  state->hud = GTK_WIDGET(gtk_builder_get_object(builder, "hud"));
   state->info_bar = GTK_WIDGET(gtk_builder_get_object(builder, "heads_info"));
   state->info_label = GTK_WIDGET(gtk_builder_get_object(builder, "heads_info_label"));
   state->menu_button = GTK_WIDGET(gtk_builder_get_object(builder, "menu_button"));
+  state->apply_title = GTK_WIDGET(gtk_builder_get_object(builder, "apply_title"));
+  state->apply_button = GTK_WIDGET(gtk_builder_get_object(builder, "apply_button"));
 
   g_signal_connect(window, "window-state-event", G_CALLBACK(window_state_changed), state);
   g_signal_connect(window, "destroy", G_CALLBACK(cleanup), state);
@@ -1029,6 +1423,11 @@ static void activate(GtkApplication* app, gpointer user_data) {
   g_signal_connect(capture_action, "change-state", G_CALLBACK(capture_selected), state);
   g_action_map_add_action(G_ACTION_MAP(main_actions), G_ACTION(capture_action));
 
+  action = g_simple_action_new_stateful("show-hud", NULL,
+      g_variant_new_boolean(state->show_hud));
+  g_signal_connect(action, "change-state", G_CALLBACK(hud_selected), state);
+  g_action_map_add_action(G_ACTION_MAP(main_actions), G_ACTION(action));
+
   GSimpleAction *overlay_action = g_simple_action_new_stateful("show-overlay", NULL,
       g_variant_new_boolean(state->show_overlay));
   g_signal_connect(overlay_action, "change-state", G_CALLBACK(overlay_selected), state);
@@ -1037,6 +1436,7 @@ static void activate(GtkApplication* app, gpointer user_data) {
   GMenu *main_menu = g_menu_new();
   g_menu_append(main_menu, "_Automatically Apply Changes", "app.auto-apply");
   g_menu_append(main_menu, "_Show Screen Contents", "app.capture-screens");
+  g_menu_append(main_menu, "Show _Performance HUD", "app.show-hud");
   g_menu_append(main_menu, "_Overlay Screen Names", "app.show-overlay");
   gtk_menu_button_set_menu_model(GTK_MENU_BUTTON(state->menu_button), G_MENU_MODEL(main_menu));
 
@@ -1045,6 +1445,12 @@ static void activate(GtkApplication* app, gpointer user_data) {
   g_autoptr(GList) info_children = gtk_container_get_children(GTK_CONTAINER(state->info_bar));
   g_signal_connect(info_children->data, "notify::child-revealed", G_CALLBACK(info_bar_animation_done), state);
 
+  if (record_path != NULL && !wd_trace_start(record_path)) {
+    wd_fatal_error(1, "Can't open the trace file for recording");
+  }
+  if (metrics_path != NULL && !wd_metrics_start(state, metrics_path)) {
+    wd_fatal_error(1, "Can't write the metrics file");
+  }
   struct wl_display *display = gdk_wayland_display_get_wl_display(gdk_display);
   wd_add_output_management_listener(state, display);
 
@@ -1068,7 +1474,7 @@ static void activate(GtkApplication* app, gpointer user_data) {
   int n_monitors = gdk_display_get_n_monitors(gdk_display);
   for (int i = 0; i < n_monitors; i++) {
     GdkMonitor *monitor = gdk_display_get_monitor(gdk_display, i);
-    wd_add_output(state, gdk_wayland_monitor_get_wl_output(monitor), display);
+    wd_add_output(state, gdk_wayland_monitor_get_wl_output(monitor));
   }
 
   g_signal_connect(gdk_display, "monitor-added", G_CALLBACK(monitor_added), state);
@@ -1078,15 +1484,48 @@ static void activate(GtkApplication* app, gpointer user_data) {
   gtk_widget_show_all(window);
   g_object_unref(builder);
   update_tick_callback(state);
+
+  g_debug("startup with %d heads took %.1fms", wl_list_length(&state->heads),
+      (g_get_monotonic_time() - startup_begin) / 1000.);
+}
+
+static gint handle_local_options(GApplication *app, GVariantDict *options,
+    gpointer user_data) {
+#ifdef WDISPLAYS_PROFILING
+  if (profile_path == NULL)
+    profile_path = g_strdup(g_getenv("WDISPLAYS_PROFILE"));
+  if (profile_path != NULL && !wd_profile_start(profile_path))
+    return 1;
+#endif
+  if (replay_path != NULL) {
+    return wd_trace_replay(replay_path);
+  }
+  if (apply_path != NULL) {
+    return wd_cli_apply(apply_path, dry_run, test_only);
+  }
+  if (dump || watch) {
+    return wd_cli_dump(watch);
+  }
+  if (dry_run || test_only) {
+    fprintf(stderr, "--dry-run and --test require --apply\n");
+    return 1;
+  }
+  return -1;
 }
 // END GLOBAL CALLBACKS
 
 int main(int argc, char *argv[]) {
+  startup_begin = g_get_monotonic_time();
   g_setenv("GDK_GL", "gles", FALSE);
   GtkApplication *app = gtk_application_new(WDISPLAYS_APP_ID, G_APPLICATION_FLAGS_NONE);
+  g_application_add_main_option_entries(G_APPLICATION(app), options);
+  g_signal_connect(app, "handle-local-options", G_CALLBACK(handle_local_options), NULL);
   g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
   int status = g_application_run(G_APPLICATION(app), argc, argv);
   g_object_unref(app);
+#ifdef WDISPLAYS_PROFILING
+  wd_profile_stop();
+#endif
 
   return status;
 }
@@ -0,0 +1,140 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Apply and capture health in the Prometheus text exposition format. The file
+ * is replaced atomically, so a collector never reads a partial write.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "wdisplays.h"
+
+#define METRICS_INTERVAL_SECS 10
+
+const double wd_metrics_latency_bounds[METRICS_LATENCY_BUCKETS] = {
+  .05, .1, .25, .5, 1., 2.5, 5., 10.
+};
+
+void wd_metrics_apply_done(struct wd_state *state, uint64_t latency) {
+  struct wd_metrics *metrics = &state->metrics;
+  for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+    if (latency <= wd_metrics_latency_bounds[i] * 1000000.)
+      metrics->apply_latency_buckets[i]++;
+  }
+  metrics->apply_latency_count++;
+  metrics->apply_latency_sum += latency;
+}
+
+static void write_counter(FILE *file, const char *name, const char *help,
+    uint64_t value) {
+  fprintf(file, "# HELP %s %s\n# TYPE %s counter\n%s %" G_GUINT64_FORMAT "\n",
+      name, help, name, name, value);
+}
+
+static void write_metrics(struct wd_state *state, FILE *file) {
+  const struct wd_metrics *metrics = &state->metrics;
+  write_counter(file, "wdisplays_apply_attempts_total",
+      "Output configurations submitted, including retries.",
+      metrics->apply_attempts);
+  write_counter(file, "wdisplays_apply_successes_total",
+      "Output configurations the compositor applied.",
+      metrics->apply_successes);
+  write_counter(file, "wdisplays_apply_failures_total",
+      "Output configurations the compositor rejected.",
+      metrics->apply_failures);
+  write_counter(file, "wdisplays_apply_cancellations_total",
+      "Output configurations cancelled by a concurrent change.",
+      metrics->apply_cancellations);
+
+  fputs("# HELP wdisplays_apply_latency_seconds "
+      "Time from an apply to the compositor's final answer.\n"
+      "# TYPE wdisplays_apply_latency_seconds histogram\n", file);
+  for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+    fprintf(file, "wdisplays_apply_latency_seconds_bucket{le=\"%g\"} %"
+        G_GUINT64_FORMAT "\n", wd_metrics_latency_bounds[i],
+        metrics->apply_latency_buckets[i]);
+  }
+  fprintf(file, "wdisplays_apply_latency_seconds_bucket{le=\"+Inf\"} %"
+      G_GUINT64_FORMAT "\n", metrics->apply_latency_count);
+  fprintf(file, "wdisplays_apply_latency_seconds_sum %.6f\n",
+      metrics->apply_latency_sum / 1000000.);
+  fprintf(file, "wdisplays_apply_latency_seconds_count %" G_GUINT64_FORMAT "\n",
+      metrics->apply_latency_count);
+
+  write_counter(file, "wdisplays_capture_failures_total",
+      "Screen captures that failed or could not be mapped.",
+      metrics->capture_failures);
+
+  fputs("# HELP wdisplays_memory_bytes Bytes held for previews.\n"
+      "# TYPE wdisplays_memory_bytes gauge\n", file);
+  for (int i = 0; i < WD_MEMORY_CATEGORIES; i++) {
+    fprintf(file, "wdisplays_memory_bytes{category=\"%s\"} %zu\n",
+        wd_memory_category_names[i], state->memory.bytes[i]);
+  }
+  fprintf(file, "wdisplays_memory_bytes{category=\"arenas\"} %zu\n",
+      state->alloc_stats.block_bytes);
+  fputs("# HELP wdisplays_memory_budget_bytes "
+      "Limit on preview memory, 0 for none.\n"
+      "# TYPE wdisplays_memory_budget_bytes gauge\n", file);
+  fprintf(file, "wdisplays_memory_budget_bytes %zu\n", state->memory.budget);
+  write_counter(file, "wdisplays_preview_releases_total",
+      "Previews released to stay within the memory budget.",
+      state->memory.releases);
+
+  fputs("# HELP wdisplays_capture_latency_seconds "
+      "Time from request to ready of the output's last screen capture.\n"
+      "# TYPE wdisplays_capture_latency_seconds gauge\n", file);
+  struct wd_output *output;
+  wl_list_for_each(output, &state->outputs, link) {
+    if (output->name != NULL && output->capture_latency > 0) {
+      /* output names are connector names, which need no escaping */
+      fprintf(file, "wdisplays_capture_latency_seconds{output=\"%s\"} %.6f\n",
+          output->name, output->capture_latency / 1000000.);
+    }
+  }
+}
+
+static bool write_file(struct wd_state *state) {
+  g_autofree gchar *tmp_path = g_strconcat(state->metrics.path, ".tmp", NULL);
+  FILE *file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "%s: %s\n", tmp_path, strerror(errno));
+    return false;
+  }
+  write_metrics(state, file);
+  if (fclose(file) != 0 || rename(tmp_path, state->metrics.path) == -1) {
+    fprintf(stderr, "%s: %s\n", state->metrics.path, strerror(errno));
+    remove(tmp_path);
+    return false;
+  }
+  return true;
+}
+
+static gboolean metrics_timeout(gpointer data) {
+  write_file(data);
+  return G_SOURCE_CONTINUE;
+}
+
+bool wd_metrics_start(struct wd_state *state, const char *path) {
+  state->metrics.path = g_strdup(path);
+  if (!write_file(state)) {
+    g_clear_pointer(&state->metrics.path, g_free);
+    return false;
+  }
+  state->metrics.timeout = g_timeout_add_seconds(METRICS_INTERVAL_SECS,
+      metrics_timeout, state);
+  return true;
+}
+
+void wd_metrics_stop(struct wd_state *state) {
+  if (state->metrics.path == NULL)
+    return;
+  g_source_remove(state->metrics.timeout);
+  write_file(state);
+  g_clear_pointer(&state->metrics.path, g_free);
+}
@@ -14,13 +14,17 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <glib.h>
+
 #include "wdisplays.h"
 
 #include "wlr-output-management-unstable-v1-client-protocol.h"
@@ -28,29 +32,79 @@
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 
+#define APPLY_RETRIES_MAX 3
+#define HEAD_ID_BITS 64 // ids tracked in wd_state.head_ids
+
+#define MODIFIED_BY_SERVER \
+  "The display configuration was modified by the server before updates were processed. " \
+  "Please check the configuration and apply the changes again."
+
 static void noop() {
   // This space is intentionally left blank
 }
 
+static uint64_t get_time_usecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * An apply in flight. bases holds each head's server state when outputs was
+ * last sent, so that a cancelled apply can tell the user's changes apart from
+ * the server's.
+ */
 struct wd_pending_config {
   struct wd_state *state;
+  struct wl_display *display;
   struct wl_list *outputs;
+  struct wl_list bases;
+  uint64_t applied_at;
+  uint32_t serial;
+  unsigned retries;
 };
 
-static void destroy_pending(struct wd_pending_config *pending) {
+static void retry_pending(struct wd_state *state);
+
+static void finish_pending(struct wd_pending_config *pending) {
+  struct wd_state *state = pending->state;
+  state->apply_inflight = NULL;
+  state->apply_retry = false;
+  state->apply_latency = get_time_usecs() - pending->applied_at;
+  wd_metrics_apply_done(state, state->apply_latency);
+}
+
+static void free_head_configs(struct wl_list *outputs, struct wd_head *head) {
   struct wd_head_config *output, *tmp;
-  wl_list_for_each_safe(output, tmp, pending->outputs, link) {
-    wl_list_remove(&output->link);
-    free(output);
+  wl_list_for_each_safe(output, tmp, outputs, link) {
+    if (head == NULL || output->head == head) {
+      wl_list_remove(&output->link);
+      free(output);
+    }
   }
+}
+
+static void destroy_pending(struct wd_pending_config *pending) {
+  free_head_configs(pending->outputs, NULL);
+  free_head_configs(&pending->bases, NULL);
   free(pending->outputs);
   free(pending);
 }
 
+static void abort_pending(struct wd_pending_config *pending,
+    const char *message) {
+  finish_pending(pending);
+  wd_ui_apply_done(pending->state, NULL);
+  wd_ui_show_error(pending->state, message);
+  destroy_pending(pending);
+}
+
 static void config_handle_succeeded(void *data,
     struct zwlr_output_configuration_v1 *config) {
   struct wd_pending_config *pending = data;
   zwlr_output_configuration_v1_destroy(config);
+  pending->state->metrics.apply_successes++;
+  finish_pending(pending);
   wd_ui_apply_done(pending->state, pending->outputs);
   destroy_pending(pending);
 }
@@ -59,21 +113,27 @@ static void config_handle_failed(void *data,
     struct zwlr_output_configuration_v1 *config) {
   struct wd_pending_config *pending = data;
   zwlr_output_configuration_v1_destroy(config);
-  wd_ui_apply_done(pending->state, NULL);
-  wd_ui_show_error(pending->state,
+  pending->state->metrics.apply_failures++;
+  abort_pending(pending,
       "The display server was not able to process your changes.");
-  destroy_pending(pending);
 }
 
 static void config_handle_cancelled(void *data,
     struct zwlr_output_configuration_v1 *config) {
   struct wd_pending_config *pending = data;
   zwlr_output_configuration_v1_destroy(config);
-  wd_ui_apply_done(pending->state, NULL);
-  wd_ui_show_error(pending->state,
-      "The display configuration was modified by the server before updates were processed. "
-      "Please check the configuration and apply the changes again.");
-  destroy_pending(pending);
+  pending->state->metrics.apply_cancellations++;
+  if (pending->retries < APPLY_RETRIES_MAX) {
+    /* the server state moved on, resubmit on top of the next done event, or
+     * right away if that has already arrived */
+    pending->retries++;
+    pending->state->apply_retry = true;
+    if (pending->serial != pending->state->serial) {
+      retry_pending(pending->state);
+    }
+    return;
+  }
+  abort_pending(pending, MODIFIED_BY_SERVER);
 }
 
 static const struct zwlr_output_configuration_v1_listener config_listener = {
@@ -82,16 +142,72 @@ static const struct zwlr_output_configuration_v1_listener config_listener = {
   .cancelled = config_handle_cancelled,
 };
 
-void wd_apply_state(struct wd_state *state, struct wl_list *new_outputs,
-    struct wl_display *display) {
-  struct zwlr_output_configuration_v1 *config =
-    zwlr_output_manager_v1_create_configuration(state->output_manager, state->serial);
+struct wd_pending_test {
+  struct wd_state *state;
+  uint32_t serial;
+  uint32_t manager_serial; // of the state the test was built on
+};
 
-  struct wd_pending_config *pending = calloc(1, sizeof(*pending));
-  pending->state = state;
-  pending->outputs = new_outputs;
+static void finish_test(struct wd_pending_test *pending, bool succeeded) {
+  /* results for anything but the latest test are stale */
+  if (pending->serial == pending->state->test_serial) {
+    pending->state->test_result = succeeded
+      ? WD_TEST_SUCCEEDED : WD_TEST_FAILED;
+    wd_ui_test_done(pending->state, succeeded);
+  }
+  free(pending);
+}
+
+static void test_handle_succeeded(void *data,
+    struct zwlr_output_configuration_v1 *config) {
+  zwlr_output_configuration_v1_destroy(config);
+  finish_test(data, true);
+}
 
-  zwlr_output_configuration_v1_add_listener(config, &config_listener, pending);
+static void test_handle_failed(void *data,
+    struct zwlr_output_configuration_v1 *config) {
+  zwlr_output_configuration_v1_destroy(config);
+  finish_test(data, false);
+}
+
+static void test_handle_cancelled(void *data,
+    struct zwlr_output_configuration_v1 *config) {
+  struct wd_pending_test *pending = data;
+  zwlr_output_configuration_v1_destroy(config);
+  struct wd_state *state = pending->state;
+  if (pending->serial == state->test_serial) {
+    /* like a cancelled apply, test again on top of the next done event, or
+     * right away if that has already arrived */
+    state->test_result = WD_TEST_CANCELLED;
+    if (pending->manager_serial != state->serial) {
+      wd_ui_test_cancelled(state);
+    } else {
+      state->test_retry = true;
+    }
+  }
+  free(pending);
+}
+
+static const struct zwlr_output_configuration_v1_listener test_listener = {
+  .succeeded = test_handle_succeeded,
+  .failed = test_handle_failed,
+  .cancelled = test_handle_cancelled,
+};
+
+/*
+ * Heads can advertise the same mode twice, and the mode table keeps only one
+ * of them, so the current mode may be a different object than the one found
+ * by size and refresh rate.
+ */
+static bool same_mode(const struct wd_mode *a, const struct wd_mode *b) {
+  return a == b || (a != NULL && b != NULL && a->width == b->width
+      && a->height == b->height && a->refresh == b->refresh);
+}
+
+static struct zwlr_output_configuration_v1 *create_configuration(
+    struct wd_state *state, struct wl_list *new_outputs) {
+  struct zwlr_output_configuration_v1 *config =
+    zwlr_output_manager_v1_create_configuration(state->output_manager, state->serial);
 
   ssize_t i = -1;
   struct wd_head_config *output;
@@ -106,16 +222,10 @@ void wd_apply_state(struct wd_state *state, struct wl_list *new_outputs,
 
     struct zwlr_output_configuration_head_v1 *config_head = zwlr_output_configuration_v1_enable_head(config, head->wlr_head);
 
-    const struct wd_mode *selected_mode = NULL;
-    const struct wd_mode *mode;
-    wl_list_for_each(mode, &head->modes, link) {
-      if (mode->width == output->width && mode->height == output->height && mode->refresh == output->refresh) {
-        selected_mode = mode;
-        break;
-      }
-    }
+    const struct wd_mode *selected_mode = wd_head_find_mode(head,
+        output->width, output->height, output->refresh);
     if (selected_mode != NULL) {
-      if (output->enabled != head->enabled || selected_mode != head->mode) {
+      if (output->enabled != head->enabled || !same_mode(selected_mode, head->mode)) {
         zwlr_output_configuration_head_v1_set_mode(config_head, selected_mode->wlr_mode);
       }
     } else if (output->enabled != head->enabled
@@ -136,12 +246,185 @@ void wd_apply_state(struct wd_state *state, struct wl_list *new_outputs,
     }
   }
 
+  return config;
+}
+
+static void send_pending(struct wd_pending_config *pending) {
+  pending->serial = pending->state->serial;
+  pending->state->metrics.apply_attempts++;
+  struct zwlr_output_configuration_v1 *config =
+    create_configuration(pending->state, pending->outputs);
+  wd_proxy_add_listener((struct wl_proxy *) config, &config_listener, pending);
   zwlr_output_configuration_v1_apply(config);
+  wl_display_flush(pending->display);
+}
 
-  wl_display_roundtrip(display);
+void wd_apply_state(struct wd_state *state, struct wl_list *new_outputs,
+    struct wl_display *display) {
+  WD_SPAN("wd_apply_state");
+  struct wd_pending_config *pending = calloc(1, sizeof(*pending));
+  pending->state = state;
+  pending->display = display;
+  pending->outputs = new_outputs;
+  wl_list_init(&pending->bases);
+  struct wd_head_config *output;
+  wl_list_for_each(output, new_outputs, link) {
+    struct wd_head_config *base = wd_head_config_new(output->head);
+    wl_list_insert(pending->bases.prev, &base->link);
+  }
+  pending->applied_at = get_time_usecs();
+  state->apply_inflight = pending;
+
+  send_pending(pending);
+}
+
+struct wd_head_config *wd_head_config_new(struct wd_head *head) {
+  struct wd_head_config *output = calloc(1, sizeof(*output));
+  output->head = head;
+  output->enabled = head->enabled;
+  output->width = head->mode != NULL ? head->mode->width : head->custom_mode.width;
+  output->height = head->mode != NULL ? head->mode->height : head->custom_mode.height;
+  output->refresh = head->mode != NULL ? head->mode->refresh : head->custom_mode.refresh;
+  output->x = head->x;
+  output->y = head->y;
+  output->scale = head->scale;
+  output->transform = head->transform;
+  return output;
+}
+
+static struct wd_head_config *find_head_config(struct wl_list *outputs,
+    const struct wd_head *head) {
+  struct wd_head_config *output;
+  wl_list_for_each(output, outputs, link) {
+    if (output->head == head) {
+      return output;
+    }
+  }
+  return NULL;
+}
+
+static enum wd_head_fields head_config_diff(const struct wd_head_config *a,
+    const struct wd_head_config *b) {
+  enum wd_head_fields fields = 0;
+  if (a->enabled != b->enabled)
+    fields |= WD_FIELD_ENABLED;
+  if (a->width != b->width || a->height != b->height
+      || a->refresh != b->refresh)
+    fields |= WD_FIELD_MODE;
+  if (a->x != b->x || a->y != b->y)
+    fields |= WD_FIELD_POSITION;
+  if (a->scale != b->scale)
+    fields |= WD_FIELD_SCALE;
+  if (a->transform != b->transform)
+    fields |= WD_FIELD_TRANSFORM;
+  return fields;
+}
+
+static void head_config_copy(struct wd_head_config *dst,
+    const struct wd_head_config *src, enum wd_head_fields fields) {
+  if (fields & WD_FIELD_ENABLED) {
+    dst->enabled = src->enabled;
+  }
+  if (fields & WD_FIELD_MODE) {
+    dst->width = src->width;
+    dst->height = src->height;
+    dst->refresh = src->refresh;
+  }
+  if (fields & WD_FIELD_POSITION) {
+    dst->x = src->x;
+    dst->y = src->y;
+  }
+  if (fields & WD_FIELD_SCALE) {
+    dst->scale = src->scale;
+  }
+  if (fields & WD_FIELD_TRANSFORM) {
+    dst->transform = src->transform;
+  }
+}
+
+/*
+ * Carries the user's changes over to the latest server state after a
+ * cancelled apply. Only the fields the user changed from the base are
+ * re-applied; everything else follows the server. Returns false if the server
+ * changed one of those fields to a different value, which needs the user to
+ * look again. Heads that appeared in the meantime are configured as the
+ * server reports them, since omitting a head is a protocol error. Heads that
+ * disappeared were already dropped in head_handle_finished.
+ */
+static bool rebase_pending(struct wd_pending_config *pending) {
+  bool conflict = false;
+  struct wd_head *head;
+  wl_list_for_each(head, &pending->state->heads, link) {
+    struct wd_head_config *current = wd_head_config_new(head);
+    struct wd_head_config *output = find_head_config(pending->outputs, head);
+    struct wd_head_config *base = find_head_config(&pending->bases, head);
+    if (output == NULL) {
+      output = wd_head_config_new(head);
+      wl_list_insert(pending->outputs->prev, &output->link);
+    }
+    if (base == NULL) {
+      base = wd_head_config_new(head);
+      wl_list_insert(pending->bases.prev, &base->link);
+    }
+
+    enum wd_head_fields ours = head_config_diff(base, output);
+    enum wd_head_fields theirs = head_config_diff(base, current);
+    if (ours & theirs & head_config_diff(output, current)) {
+      conflict = true;
+    }
+    head_config_copy(base, current, WD_FIELDS_ALL);
+    head_config_copy(current, output, ours);
+    head_config_copy(output, current, WD_FIELDS_ALL);
+    free(current);
+  }
+  return !conflict;
 }
 
+static void retry_pending(struct wd_state *state) {
+  struct wd_pending_config *pending = state->apply_inflight;
+  state->apply_retry = false;
+  if (!rebase_pending(pending)) {
+    abort_pending(pending, MODIFIED_BY_SERVER);
+    return;
+  }
+  send_pending(pending);
+}
+
+void wd_test_state(struct wd_state *state, struct wl_list *new_outputs,
+    struct wl_display *display) {
+  struct zwlr_output_configuration_v1 *config =
+    create_configuration(state, new_outputs);
+
+  struct wd_pending_test *pending = calloc(1, sizeof(*pending));
+  pending->state = state;
+  pending->serial = ++state->test_serial;
+  pending->manager_serial = state->serial;
+  state->test_result = WD_TEST_PENDING;
+  state->test_retry = false;
+
+  wd_proxy_add_listener((struct wl_proxy *) config, &test_listener, pending);
+  zwlr_output_configuration_v1_test(config);
+
+  struct wd_head_config *output, *tmp;
+  wl_list_for_each_safe(output, tmp, new_outputs, link) {
+    wl_list_remove(&output->link);
+    free(output);
+  }
+  free(new_outputs);
+
+  wl_display_flush(display);
+}
+
+const char *const wd_memory_category_names[WD_MEMORY_CATEGORIES] = {
+  [WD_MEMORY_FRAMES] = "frames",
+  [WD_MEMORY_TEXTURES] = "textures",
+  [WD_MEMORY_LABELS] = "labels",
+};
+
 static void wd_frame_destroy(struct wd_frame *frame) {
+  if (frame->pool != NULL)
+    frame->output->state->memory.bytes[WD_MEMORY_FRAMES] -=
+      frame->height * frame->stride;
   if (frame->pixels != NULL)
     munmap(frame->pixels, frame->height * frame->stride);
   if (frame->buffer != NULL)
@@ -157,7 +440,7 @@ static void wd_frame_destroy(struct wd_frame *frame) {
   free(frame);
 }
 
-static int create_shm_file(size_t size, const char *fmt, ...) {
+int wd_create_shm_file(size_t size, const char *fmt, ...) {
   char *shm_name = NULL;
   int fd = -1;
 
@@ -192,6 +475,7 @@ static int create_shm_file(size_t size, const char *fmt, ...) {
 static void capture_buffer(void *data,
     struct zwlr_screencopy_frame_v1 *copy_frame,
     uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+  WD_SPAN("capture_buffer");
   struct wd_frame *frame = data;
 
   if (format != WL_SHM_FORMAT_ARGB8888 && format != WL_SHM_FORMAT_XRGB8888 &&
@@ -200,7 +484,7 @@ static void capture_buffer(void *data,
   }
 
   size_t size = stride * height;
-  frame->capture_fd = create_shm_file(size, "/wd-%s", frame->output->name);
+  frame->capture_fd = wd_create_shm_file(size, "/wd-%s", frame->output->name);
   if (frame->capture_fd == -1) {
     goto err;
   }
@@ -213,17 +497,20 @@ static void capture_buffer(void *data,
   frame->stride = stride;
   frame->width = width;
   frame->height = height;
+  frame->output->state->memory.bytes[WD_MEMORY_FRAMES] += size;
   frame->swap_rgb = format == WL_SHM_FORMAT_ABGR8888
     || format == WL_SHM_FORMAT_XBGR8888;
 
   return;
 err:
+  frame->output->state->metrics.capture_failures++;
   wd_frame_destroy(frame);
 }
 
 static void capture_flags(void *data,
     struct zwlr_screencopy_frame_v1 *wlr_frame,
     uint32_t flags) {
+  WD_SPAN("capture_flags");
   struct wd_frame *frame = data;
   frame->y_invert = !!(flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT);
 }
@@ -231,6 +518,7 @@ static void capture_flags(void *data,
 static void capture_ready(void *data,
     struct zwlr_screencopy_frame_v1 *wlr_frame,
     uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+  WD_SPAN("capture_ready");
   struct wd_frame *frame = data;
 
   frame->pixels = mmap(NULL, frame->stride * frame->height,
@@ -238,11 +526,14 @@ static void capture_ready(void *data,
   if (frame->pixels == MAP_FAILED) {
     frame->pixels = NULL;
     fprintf(stderr, "mmap: %d: %s\n", frame->capture_fd, strerror(errno));
+    frame->output->state->metrics.capture_failures++;
     wd_frame_destroy(frame);
     return;
   } else {
     uint64_t tv_sec = (uint64_t) tv_sec_hi << 32 | tv_sec_lo;
     frame->tick = (tv_sec * 1000000) + (tv_nsec / 1000);
+    frame->output->capture_latency =
+      g_get_monotonic_time() - frame->requested_at;
   }
 
   zwlr_screencopy_frame_v1_destroy(frame->wlr_frame);
@@ -258,7 +549,9 @@ static void capture_ready(void *data,
 
 static void capture_failed(void *data,
     struct zwlr_screencopy_frame_v1 *wlr_frame) {
+  WD_SPAN("capture_failed");
   struct wd_frame *frame = data;
+  frame->output->state->metrics.capture_failures++;
   wd_frame_destroy(frame);
 }
 
@@ -283,61 +576,287 @@ static bool has_pending_captures(struct wd_state *state) {
 }
 
 void wd_capture_frame(struct wd_state *state) {
+  WD_SPAN("wd_capture_frame");
   if (state->copy_manager == NULL || has_pending_captures(state)
       || !state->capture) {
     return;
   }
 
+  wd_trace_capture();
   struct wd_output *output;
   wl_list_for_each(output, &state->outputs, link) {
+    if (output->preview_released)
+      continue;
     struct wd_frame *frame = calloc(1, sizeof(*frame));
     frame->output = output;
     frame->capture_fd = -1;
+    frame->requested_at = g_get_monotonic_time();
     frame->wlr_frame =
       zwlr_screencopy_manager_v1_capture_output(state->copy_manager, 1,
         output->wl_output);
-    zwlr_screencopy_frame_v1_add_listener(frame->wlr_frame, &capture_listener,
-        frame);
+    wd_proxy_add_listener((struct wl_proxy *) frame->wlr_frame,
+        &capture_listener, frame);
     wl_list_insert(&output->frames, &frame->link);
   }
 }
 
+void wd_output_release_preview(struct wd_output *output) {
+  struct wd_frame *frame, *frame_tmp;
+  wl_list_for_each_safe(frame, frame_tmp, &output->frames, link) {
+    wd_frame_destroy(frame);
+  }
+  output->preview_released = true;
+  output->state->memory.releases++;
+}
+
 static void wd_output_destroy(struct wd_output *output) {
+  /* destroying a screencopy frame cancels it, even while the compositor is
+   * still copying, so captures in flight never have to be waited for */
   struct wd_frame *frame, *frame_tmp;
   wl_list_for_each_safe(frame, frame_tmp, &output->frames, link) {
     wd_frame_destroy(frame);
   }
+  if (output->name != NULL) {
+    struct wd_head *head = wd_find_head(output->state, output);
+    if (head != NULL && head->output == output) {
+      head->output = NULL;
+    }
+    if (g_hash_table_lookup(output->state->outputs_by_name, output->name) == output) {
+      g_hash_table_remove(output->state->outputs_by_name, output->name);
+    }
+  }
   if (output->state->layer_shell != NULL) {
     wd_destroy_overlay(output);
   }
   zxdg_output_v1_destroy(output->xdg_output);
-  free(output->name);
   free(output);
 }
 
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN 16
+
+struct wd_arena_block {
+  struct wd_arena_block *next;
+  size_t size;
+  _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+static void *wd_arena_alloc(struct wd_state *state, struct wd_arena *arena,
+    size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  struct wd_arena_block *block = arena->blocks;
+  if (block == NULL || block->size - arena->used < size) {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = calloc(1, sizeof(*block) + block_size);
+    block->size = block_size;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->used = 0;
+    state->alloc_stats.block_allocs++;
+    state->alloc_stats.block_bytes += block_size;
+  }
+  void *ptr = block->data + arena->used;
+  arena->used += size;
+  state->alloc_stats.arena_allocs++;
+  return ptr;
+}
+
+static char *wd_arena_strdup(struct wd_state *state, struct wd_arena *arena,
+    const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = wd_arena_alloc(state, arena, len);
+  memcpy(copy, str, len);
+  return copy;
+}
+
+/*
+ * Frees every block of the arena. The arena itself may live inside one of
+ * them, so it is passed by value.
+ */
+static void wd_arena_release(struct wd_state *state, struct wd_arena arena) {
+  struct wd_arena_block *block = arena.blocks;
+  while (block != NULL) {
+    struct wd_arena_block *next = block->next;
+    state->alloc_stats.block_frees++;
+    state->alloc_stats.block_bytes -= block->size;
+    free(block);
+    block = next;
+  }
+}
+
+/*
+ * Modes live in their head's arena, so a finished mode is kept on a free
+ * list for the next one the head advertises.
+ */
 static void wd_mode_destroy(struct wd_mode* mode) {
   zwlr_output_mode_v1_destroy(mode->wlr_mode);
-  free(mode);
+  wl_list_insert(&mode->head->free_modes, &mode->link);
+}
+
+static inline int64_t mode_key(int32_t width, int32_t height,
+    int32_t refresh) {
+  return (int64_t) ((uint64_t) (width & 0xffff) << 48
+      | (uint64_t) (height & 0xffff) << 32 | (uint32_t) refresh);
+}
+
+static int compare_modes(const void *a, const void *b) {
+  const struct wd_mode *mode_a = *(struct wd_mode * const *) a;
+  const struct wd_mode *mode_b = *(struct wd_mode * const *) b;
+  if (mode_a->width != mode_b->width)
+    return mode_b->width - mode_a->width;
+  if (mode_a->height != mode_b->height)
+    return mode_b->height - mode_a->height;
+  if (mode_a->refresh != mode_b->refresh)
+    return mode_b->refresh > mode_a->refresh ? 1 : -1;
+  return mode_b->preferred - mode_a->preferred;
+}
+
+static guint mode_table_hash(gconstpointer key) {
+  const struct wd_mode_table *table = key;
+  return table->hash;
+}
+
+static gboolean mode_table_equal(gconstpointer a, gconstpointer b) {
+  const struct wd_mode_table *table_a = a;
+  const struct wd_mode_table *table_b = b;
+  if (table_a->hash != table_b->hash || table_a->len != table_b->len) {
+    return FALSE;
+  }
+  for (size_t i = 0; i < table_a->len; i++) {
+    if (table_a->entries[i].key != table_b->entries[i].key
+        || table_a->entries[i].preferred != table_b->entries[i].preferred) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static void wd_mode_table_unref(struct wd_state *state,
+    struct wd_mode_table *table) {
+  if (--table->refs > 0) {
+    return;
+  }
+  g_hash_table_remove(state->mode_tables, table);
+  g_hash_table_destroy(table->index);
+  free(table->entries);
+  free(table);
+}
+
+/*
+ * Returns the interned table with the given entries, creating it if no head
+ * uses one yet. Takes ownership of the entries.
+ */
+static struct wd_mode_table *intern_mode_table(struct wd_state *state,
+    struct wd_mode_entry *entries, size_t len) {
+  guint hash = len;
+  for (size_t i = 0; i < len; i++) {
+    hash = hash * 31 + g_int64_hash(&entries[i].key) + entries[i].preferred;
+  }
+  struct wd_mode_table probe = {
+    .hash = hash,
+    .len = len,
+    .entries = entries,
+  };
+  struct wd_mode_table *table = g_hash_table_lookup(state->mode_tables, &probe);
+  if (table != NULL) {
+    free(entries);
+    table->refs++;
+    return table;
+  }
+
+  table = calloc(1, sizeof(*table));
+  *table = probe;
+  table->refs = 1;
+  /* the entries are not reallocated after this, so their keys can be used
+   * in place */
+  table->index = g_hash_table_new(g_int64_hash, g_int64_equal);
+  for (size_t i = 0; i < len; i++) {
+    g_hash_table_insert(table->index, &entries[i].key,
+        GSIZE_TO_POINTER(i + 1));
+  }
+  g_hash_table_add(state->mode_tables, table);
+  return table;
+}
+
+static void update_mode_table(struct wd_head *head) {
+  if (head->mode_table != NULL) {
+    wd_mode_table_unref(head->state, head->mode_table);
+  }
+  free(head->table_modes);
+
+  size_t count = wl_list_length(&head->modes);
+  struct wd_mode **sorted = calloc(count, sizeof(*sorted));
+  size_t i = 0;
+  struct wd_mode *mode;
+  wl_list_for_each(mode, &head->modes, link) {
+    sorted[i++] = mode;
+  }
+  qsort(sorted, count, sizeof(*sorted), compare_modes);
+
+  struct wd_mode_entry *entries = calloc(count, sizeof(*entries));
+  size_t len = 0;
+  head->table_modes = calloc(count, sizeof(*head->table_modes));
+  for (i = 0; i < count; i++) {
+    mode = sorted[i];
+    int64_t key = mode_key(mode->width, mode->height, mode->refresh);
+    if (len > 0 && entries[len - 1].key == key) {
+      continue;
+    }
+    struct wd_mode_entry *entry = &entries[len];
+    entry->key = key;
+    entry->width = mode->width;
+    entry->height = mode->height;
+    entry->refresh = mode->refresh;
+    entry->preferred = mode->preferred;
+    head->table_modes[len] = mode;
+    len++;
+  }
+  free(sorted);
+
+  head->mode_table = intern_mode_table(head->state, entries, len);
+}
+
+struct wd_mode *wd_head_find_mode(const struct wd_head *head,
+    int32_t width, int32_t height, int32_t refresh) {
+  if (head->mode_table == NULL) {
+    return NULL;
+  }
+  int64_t key = mode_key(width, height, refresh);
+  gsize i = GPOINTER_TO_SIZE(g_hash_table_lookup(head->mode_table->index, &key));
+  return i > 0 ? head->table_modes[i - 1] : NULL;
 }
 
 static void wd_head_destroy(struct wd_head *head) {
   if (head->state->clicked == head->render) {
     head->state->clicked = NULL;
   }
+  if (head->state->drag_head == head) {
+    head->state->drag_head = NULL;
+  }
   if (head->render != NULL) {
     wl_list_remove(&head->render->link);
     free(head->render);
     head->render = NULL;
   }
-  struct wd_mode *mode, *mode_tmp;
-  wl_list_for_each_safe(mode, mode_tmp, &head->modes, link) {
+  struct wd_mode *mode;
+  wl_list_for_each(mode, &head->modes, link) {
     zwlr_output_mode_v1_destroy(mode->wlr_mode);
-    free(mode);
   }
+  if (head->mode_table != NULL) {
+    wd_mode_table_unref(head->state, head->mode_table);
+  }
+  free(head->table_modes);
   zwlr_output_head_v1_destroy(head->wlr_head);
-  free(head->name);
-  free(head->description);
-  free(head);
+  if (head->name != NULL
+      && g_hash_table_lookup(head->state->heads_by_name, head->name) == head) {
+    g_hash_table_remove(head->state->heads_by_name, head->name);
+  }
+  struct wd_state *state = head->state;
+  wd_arena_release(state, head->arena);
+  g_debug("arena: %" PRIu64 " allocs, %" PRIu64 " reuses, %" PRIu64
+      " blocks allocated, %zu bytes held",
+      state->alloc_stats.arena_allocs, state->alloc_stats.arena_reuses,
+      state->alloc_stats.block_allocs, state->alloc_stats.block_bytes);
 }
 
 static void mode_handle_size(void *data, struct zwlr_output_mode_v1 *wlr_mode,
@@ -345,23 +864,40 @@ static void mode_handle_size(void *data, struct zwlr_output_mode_v1 *wlr_mode,
   struct wd_mode *mode = data;
   mode->width = width;
   mode->height = height;
+  mode->head->dirty |= WD_FIELD_MODE;
 }
 
 static void mode_handle_refresh(void *data,
     struct zwlr_output_mode_v1 *wlr_mode, int32_t refresh) {
   struct wd_mode *mode = data;
   mode->refresh = refresh;
+  mode->head->dirty |= WD_FIELD_MODE;
 }
 
 static void mode_handle_preferred(void *data,
     struct zwlr_output_mode_v1 *wlr_mode) {
   struct wd_mode *mode = data;
   mode->preferred = true;
+  mode->head->dirty |= WD_FIELD_MODE;
 }
 
 static void mode_handle_finished(void *data,
     struct zwlr_output_mode_v1 *wlr_mode) {
   struct wd_mode *mode = data;
+  struct wd_head *head = mode->head;
+  if (head->mode == mode) {
+    head->mode = NULL;
+  }
+  /* the table is shared with other heads and rebuilt on the next done
+   * event, until then lookups must not return this mode */
+  if (head->mode_table != NULL) {
+    for (size_t i = 0; i < head->mode_table->len; i++) {
+      if (head->table_modes[i] == mode) {
+        head->table_modes[i] = NULL;
+      }
+    }
+  }
+  head->dirty |= WD_FIELD_MODE;
   wl_list_remove(&mode->link);
   wd_mode_destroy(mode);
 }
@@ -376,15 +912,24 @@ static const struct zwlr_output_mode_v1_listener mode_listener = {
 static void head_handle_name(void *data,
     struct zwlr_output_head_v1 *wlr_head, const char *name) {
   struct wd_head *head = data;
-  head->name = strdup(name);
-  wd_ui_reset_head(head, WD_FIELD_NAME);
+  struct wd_state *state = head->state;
+  if (head->name != NULL
+      && g_hash_table_lookup(state->heads_by_name, head->name) == head) {
+    g_hash_table_remove(state->heads_by_name, head->name);
+  }
+  head->name = g_intern_string(name);
+  g_hash_table_insert(state->heads_by_name, (gpointer) head->name, head);
+  head->output = g_hash_table_lookup(state->outputs_by_name, head->name);
+  head->dirty |= WD_FIELD_NAME;
 }
 
 static void head_handle_description(void *data,
     struct zwlr_output_head_v1 *wlr_head, const char *description) {
   struct wd_head *head = data;
-  head->description = strdup(description);
-  wd_ui_reset_head(head, WD_FIELD_DESCRIPTION);
+  if (head->description == NULL || strcmp(head->description, description) != 0) {
+    head->description = wd_arena_strdup(head->state, &head->arena, description);
+  }
+  head->dirty |= WD_FIELD_DESCRIPTION;
 }
 
 static void head_handle_physical_size(void *data,
@@ -392,7 +937,7 @@ static void head_handle_physical_size(void *data,
   struct wd_head *head = data;
   head->phys_width = width;
   head->phys_height = height;
-  wd_ui_reset_head(head, WD_FIELD_PHYSICAL_SIZE);
+  head->dirty |= WD_FIELD_PHYSICAL_SIZE;
 }
 
 static void head_handle_mode(void *data,
@@ -400,22 +945,28 @@ static void head_handle_mode(void *data,
     struct zwlr_output_mode_v1 *wlr_mode) {
   struct wd_head *head = data;
 
-  struct wd_mode *mode = calloc(1, sizeof(*mode));
+  struct wd_mode *mode;
+  if (!wl_list_empty(&head->free_modes)) {
+    mode = wl_container_of(head->free_modes.next, mode, link);
+    wl_list_remove(&mode->link);
+    memset(mode, 0, sizeof(*mode));
+    head->state->alloc_stats.arena_reuses++;
+  } else {
+    mode = wd_arena_alloc(head->state, &head->arena, sizeof(*mode));
+  }
   mode->head = head;
   mode->wlr_mode = wlr_mode;
   wl_list_insert(head->modes.prev, &mode->link);
+  head->dirty |= WD_FIELD_MODE;
 
-  zwlr_output_mode_v1_add_listener(wlr_mode, &mode_listener, mode);
+  wd_proxy_add_listener((struct wl_proxy *) wlr_mode, &mode_listener, mode);
 }
 
 static void head_handle_enabled(void *data,
     struct zwlr_output_head_v1 *wlr_head, int32_t enabled) {
   struct wd_head *head = data;
   head->enabled = !!enabled;
-  if (!enabled) {
-    head->output = NULL;
-  }
-  wd_ui_reset_head(head, WD_FIELD_ENABLED);
+  head->dirty |= WD_FIELD_ENABLED;
 }
 
 static void head_handle_current_mode(void *data,
@@ -426,7 +977,7 @@ static void head_handle_current_mode(void *data,
   wl_list_for_each(mode, &head->modes, link) {
     if (mode->wlr_mode == wlr_mode) {
       head->mode = mode;
-      wd_ui_reset_head(head, WD_FIELD_MODE);
+      head->dirty |= WD_FIELD_MODE;
       return;
     }
   }
@@ -439,40 +990,35 @@ static void head_handle_position(void *data,
   struct wd_head *head = data;
   head->x = x;
   head->y = y;
-  wd_ui_reset_head(head, WD_FIELD_POSITION);
+  head->dirty |= WD_FIELD_POSITION;
 }
 
 static void head_handle_transform(void *data,
     struct zwlr_output_head_v1 *wlr_head, int32_t transform) {
   struct wd_head *head = data;
   head->transform = transform;
-  wd_ui_reset_head(head, WD_FIELD_TRANSFORM);
+  head->dirty |= WD_FIELD_TRANSFORM;
 }
 
 static void head_handle_scale(void *data,
     struct zwlr_output_head_v1 *wlr_head, wl_fixed_t scale) {
   struct wd_head *head = data;
   head->scale = wl_fixed_to_double(scale);
-  wd_ui_reset_head(head, WD_FIELD_SCALE);
+  head->dirty |= WD_FIELD_SCALE;
 }
 
 static void head_handle_finished(void *data,
     struct zwlr_output_head_v1 *wlr_head) {
   struct wd_head *head = data;
   struct wd_state *state = head->state;
+  if (state->apply_inflight != NULL) {
+    free_head_configs(state->apply_inflight->outputs, head);
+    free_head_configs(&state->apply_inflight->bases, head);
+  }
+  release_head_id(state, head->id);
+  wd_ui_remove_head(head);
   wl_list_remove(&head->link);
   wd_head_destroy(head);
-
-  uint32_t counter = 0;
-  wl_list_for_each(head, &state->heads, link) {
-    if (head->id != counter) {
-      head->id = counter;
-      if (head->output != NULL) {
-        wd_redraw_overlay(head->output);
-      }
-    }
-    counter++;
-  }
 }
 
 static const struct zwlr_output_head_v1_listener head_listener = {
@@ -488,20 +1034,47 @@ static const struct zwlr_output_head_v1_listener head_listener = {
   .finished = head_handle_finished,
 };
 
+/*
+ * Head ids are shown by --dump and --watch, so the lowest free one is reused
+ * rather than counting up through every hotplug. An id freed by a removed
+ * head only becomes free after the next done event, so one update never
+ * reports the same id as removed and added.
+ */
+static uint32_t alloc_head_id(struct wd_state *state) {
+  uint64_t taken = state->head_ids | state->released_head_ids;
+  if (~taken == 0) {
+    /* more than 64 heads came and went within one update */
+    return state->next_head_id++;
+  }
+  uint32_t id = __builtin_ctzll(~taken);
+  state->head_ids |= UINT64_C(1) << id;
+  return id;
+}
+
+static void release_head_id(struct wd_state *state, uint32_t id) {
+  if (id < HEAD_ID_BITS) {
+    state->head_ids &= ~(UINT64_C(1) << id);
+    state->released_head_ids |= UINT64_C(1) << id;
+  }
+}
+
 static void output_manager_handle_head(void *data,
     struct zwlr_output_manager_v1 *manager,
     struct zwlr_output_head_v1 *wlr_head) {
   struct wd_state *state = data;
 
-  struct wd_head *head = calloc(1, sizeof(*head));
+  struct wd_arena arena = {0};
+  struct wd_head *head = wd_arena_alloc(state, &arena, sizeof(*head));
+  head->arena = arena;
   head->state = state;
   head->wlr_head = wlr_head;
   head->scale = 1.0;
-  head->id = wl_list_length(&state->heads);
+  head->id = alloc_head_id(state);
   wl_list_init(&head->modes);
+  wl_list_init(&head->free_modes);
   wl_list_insert(&state->heads, &head->link);
 
-  zwlr_output_head_v1_add_listener(wlr_head, &head_listener, head);
+  wd_proxy_add_listener((struct wl_proxy *) wlr_head, &head_listener, head);
 }
 
 static void output_manager_handle_done(void *data,
@@ -519,8 +1092,28 @@ static void output_manager_handle_done(void *data,
       head->custom_mode.height = mode->height;
       head->custom_mode.refresh = mode->refresh;
     }
+    if (head->dirty & WD_FIELD_MODE) {
+      update_mode_table(head);
+    }
+  }
+  if (state->apply_retry) {
+    retry_pending(state);
   }
   wd_ui_reset_heads(state);
+  if (state->test_retry) {
+    state->test_retry = false;
+    wd_ui_test_cancelled(state);
+  }
+  if (state->done_hook != NULL) {
+    state->done_hook(state);
+  }
+  wl_list_for_each(head, &state->heads, link) {
+    if (head->dirty && head->output != NULL) {
+      wd_redraw_overlay(head->output);
+    }
+    head->dirty = 0;
+  }
+  state->released_head_ids = 0;
 }
 
 static const struct zwlr_output_manager_v1_listener output_manager_listener = {
@@ -535,7 +1128,7 @@ static void registry_handle_global(void *data, struct wl_registry *registry,
   if (strcmp(interface, zwlr_output_manager_v1_interface.name) == 0) {
     state->output_manager = wl_registry_bind(registry, name,
         &zwlr_output_manager_v1_interface, 1);
-    zwlr_output_manager_v1_add_listener(state->output_manager,
+    wd_proxy_add_listener((struct wl_proxy *) state->output_manager,
         &output_manager_listener, state);
   } else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
     state->xdg_output_manager = wl_registry_bind(registry, name,
@@ -548,6 +1141,10 @@ static void registry_handle_global(void *data, struct wl_registry *registry,
         &zwlr_layer_shell_v1_interface, 1);
   } else if(strcmp(interface, wl_shm_interface.name) == 0) {
     state->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+  } else if(strcmp(interface, wl_compositor_interface.name) == 0) {
+    /* version 3 for wl_surface.set_buffer_scale on the overlays */
+    state->compositor = wl_registry_bind(registry, name,
+        &wl_compositor_interface, version < 3 ? version : 3);
   }
 }
 
@@ -556,25 +1153,30 @@ static const struct wl_registry_listener registry_listener = {
   .global_remove = noop,
 };
 
+struct wl_registry *wd_listen_registry(struct wd_state *state,
+    struct wl_display *display) {
+  struct wl_registry *registry = wl_display_get_registry(display);
+  wd_proxy_add_listener((struct wl_proxy *) registry, &registry_listener,
+      state);
+  return registry;
+}
+
 void wd_add_output_management_listener(struct wd_state *state, struct
     wl_display *display) {
-  struct wl_registry *registry = wl_display_get_registry(display);
-  wl_registry_add_listener(registry, &registry_listener, state);
+  wd_listen_registry(state, display);
 
-  wl_display_dispatch(display);
+  /* the first roundtrip binds the globals, the second collects the heads
+   * the output manager sends in response to the bind */
+  wl_display_roundtrip(display);
   wl_display_roundtrip(display);
 }
 
 struct wd_head *wd_find_head(struct wd_state *state,
     struct wd_output *output) {
-  struct wd_head *head;
-  wl_list_for_each(head, &state->heads, link) {
-    if (output->name != NULL && strcmp(output->name, head->name) == 0) {
-      head->output = output;
-      return head;
-    }
+  if (output->name == NULL) {
+    return NULL;
   }
-  return NULL;
+  return g_hash_table_lookup(state->heads_by_name, output->name);
 }
 
 static void output_logical_position(void *data, struct zxdg_output_v1 *zxdg_output_v1,
@@ -584,49 +1186,66 @@ static void output_logical_position(void *data, struct zxdg_output_v1 *zxdg_outp
   if (head != NULL) {
     head->x = x;
     head->y = y;
-    wd_ui_reset_head(head, WD_FIELD_POSITION);
+    output->dirty |= WD_FIELD_POSITION;
   }
 }
 
 static void output_name(void *data, struct zxdg_output_v1 *zxdg_output_v1,
     const char *name) {
   struct wd_output *output = data;
-  if (output->name != NULL) {
-    free(output->name);
+  struct wd_state *state = output->state;
+  if (output->name != NULL
+      && g_hash_table_lookup(state->outputs_by_name, output->name) == output) {
+    g_hash_table_remove(state->outputs_by_name, output->name);
   }
-  output->name = strdup(name);
-  struct wd_head *head = wd_find_head(output->state, output);
+  output->name = g_intern_string(name);
+  g_hash_table_insert(state->outputs_by_name, (gpointer) output->name, output);
+  struct wd_head *head = wd_find_head(state, output);
   if (head != NULL) {
-    wd_ui_reset_head(head, WD_FIELD_NAME);
+    head->output = output;
+    output->dirty |= WD_FIELD_NAME;
+  }
+}
+
+static void output_done(void *data, struct zxdg_output_v1 *zxdg_output_v1) {
+  struct wd_output *output = data;
+  struct wd_head *head = wd_find_head(output->state, output);
+  /* head->dirty is left to the output manager's own done event */
+  if (head != NULL && output->dirty) {
+    wd_ui_reset_head(head, output->dirty);
+    wd_redraw_overlay(output);
+  }
+  output->dirty = 0;
+  /* overlays need the output name, which is only known at this point */
+  if (head != NULL && output->overlay_surface == NULL
+      && output->state->layer_shell != NULL && output->state->show_overlay) {
+    wd_create_overlay(output);
   }
 }
 
 static const struct zxdg_output_v1_listener output_listener = {
   .logical_position = output_logical_position,
   .logical_size = noop,
-  .done = noop,
+  .done = output_done,
   .name = output_name,
   .description = noop
 };
 
-void wd_add_output(struct wd_state *state, struct wl_output *wl_output,
-    struct wl_display *display) {
+void wd_add_output(struct wd_state *state, struct wl_output *wl_output) {
+  wd_trace_output(true, wl_output);
   struct wd_output *output = calloc(1, sizeof(*output));
   output->state = state;
   output->wl_output = wl_output;
   output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
       state->xdg_output_manager, wl_output);
   wl_list_init(&output->frames);
-  zxdg_output_v1_add_listener(output->xdg_output, &output_listener, output);
+  wd_proxy_add_listener((struct wl_proxy *) output->xdg_output,
+      &output_listener, output);
   wl_list_insert(output->state->outputs.prev, &output->link);
-  if (state->layer_shell != NULL && state->show_overlay) {
-    wl_display_roundtrip(display);
-    wd_create_overlay(output);
-  }
 }
 
-void wd_remove_output(struct wd_state *state, struct wl_output *wl_output,
-    struct wl_display *display) {
+void wd_remove_output(struct wd_state *state, struct wl_output *wl_output) {
+  wd_trace_output(false, wl_output);
   struct wd_output *output, *output_tmp;
   wl_list_for_each_safe(output, output_tmp, &state->outputs, link) {
     if (output->wl_output == wl_output) {
@@ -635,26 +1254,11 @@ void wd_remove_output(struct wd_state *state, struct wl_output *wl_output,
       break;
     }
   }
-  wd_capture_wait(state, display);
 }
 
 struct wd_output *wd_find_output(struct wd_state *state, struct wd_head
     *head) {
-  if (!head->enabled) {
-    return NULL;
-  }
-  if (head->output != NULL) {
-    return head->output;
-  }
-  struct wd_output *output;
-  wl_list_for_each(output, &state->outputs, link) {
-    if (output->name != NULL && strcmp(output->name, head->name) == 0) {
-      head->output = output;
-      return output;
-    }
-  }
-  head->output = NULL;
-  return NULL;
+  return head->enabled ? head->output : NULL;
 }
 
 struct wd_state *wd_state_create(void) {
@@ -662,38 +1266,46 @@ struct wd_state *wd_state_create(void) {
   state->zoom = 1.;
   state->capture = true;
   state->show_overlay = true;
+  state->next_head_id = HEAD_ID_BITS;
   wl_list_init(&state->heads);
   wl_list_init(&state->outputs);
   wl_list_init(&state->render.heads);
+  /* names are interned, so the indices hash and compare pointers */
+  state->heads_by_name = g_hash_table_new(g_direct_hash, g_direct_equal);
+  state->outputs_by_name = g_hash_table_new(g_direct_hash, g_direct_equal);
+  state->mode_tables = g_hash_table_new(mode_table_hash, mode_table_equal);
   return state;
 }
 
-void wd_capture_wait(struct wd_state *state, struct wl_display *display) {
-  wl_display_flush(display);
-  while (has_pending_captures(state)) {
-    if (wl_display_dispatch(display) == -1) {
-      break;
-    }
-  }
-}
-
 void wd_state_destroy(struct wd_state *state) {
-  struct wd_head *head, *head_tmp;
-  wl_list_for_each_safe(head, head_tmp, &state->heads, link) {
-    wd_head_destroy(head);
-  }
   struct wd_output *output, *output_tmp;
   wl_list_for_each_safe(output, output_tmp, &state->outputs, link) {
     wd_output_destroy(output);
   }
+  struct wd_head *head, *head_tmp;
+  wl_list_for_each_safe(head, head_tmp, &state->heads, link) {
+    wd_head_destroy(head);
+  }
   if (state->layer_shell != NULL) {
     zwlr_layer_shell_v1_destroy(state->layer_shell);
   }
   if (state->copy_manager != NULL) {
     zwlr_screencopy_manager_v1_destroy(state->copy_manager);
   }
-  zwlr_output_manager_v1_destroy(state->output_manager);
-  zxdg_output_manager_v1_destroy(state->xdg_output_manager);
-  wl_shm_destroy(state->shm);
+  if (state->output_manager != NULL) {
+    zwlr_output_manager_v1_destroy(state->output_manager);
+  }
+  if (state->xdg_output_manager != NULL) {
+    zxdg_output_manager_v1_destroy(state->xdg_output_manager);
+  }
+  if (state->shm != NULL) {
+    wl_shm_destroy(state->shm);
+  }
+  if (state->compositor != NULL) {
+    wl_compositor_destroy(state->compositor);
+  }
+  g_hash_table_destroy(state->heads_by_name);
+  g_hash_table_destroy(state->outputs_by_name);
+  g_hash_table_destroy(state->mode_tables);
   free(state);
 }
@@ -5,9 +5,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <math.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <gtk/gtk.h>
-#include <gdk/gdkwayland.h>
 
 #include "wdisplays.h"
 
@@ -15,16 +18,46 @@
 
 #define SCREEN_MARGIN_PERCENT 0.02
 
+static void draw_buffer(struct wd_output *output);
+
+/*
+ * Overlays are drawn at the output's scale, rounded up to the integer scale
+ * that wl_surface supports. Compositors before wl_compositor 3 only take 1.
+ */
+static int32_t get_buffer_scale(struct wd_output *output) {
+  struct wd_head *head = wd_find_head(output->state, output);
+  if (head == NULL || wl_proxy_get_version((struct wl_proxy *)
+        output->overlay_surface) < WL_SURFACE_SET_BUFFER_SCALE_SINCE_VERSION) {
+    return 1;
+  }
+  return MAX((int32_t) ceil(head->scale), 1);
+}
+
 static void layer_surface_configure(void *data,
     struct zwlr_layer_surface_v1 *surface,
     uint32_t serial, uint32_t width, uint32_t height) {
   struct wd_output *output = data;
-  gtk_widget_set_size_request(output->overlay_window, width, height);
   zwlr_layer_surface_v1_ack_configure(surface, serial);
+  /* zero leaves the size to us, so the requested one stands */
+  output->overlay_configured_width = width > 0 ? width : output->overlay_width;
+  output->overlay_configured_height =
+    height > 0 ? height : output->overlay_height;
+  output->overlay_configured = true;
+  if (output->overlay_buffer != NULL
+      && output->overlay_configured_width == output->overlay_buffer_width
+      && output->overlay_configured_height == output->overlay_buffer_height
+      && get_buffer_scale(output) == output->overlay_buffer_scale) {
+    /* the attached buffer already has this size */
+    wl_surface_commit(output->overlay_surface);
+    return;
+  }
+  draw_buffer(output);
 }
 
 static void layer_surface_closed(void *data,
     struct zwlr_layer_surface_v1 *surface) {
+  struct wd_output *output = data;
+  wd_destroy_overlay(output);
 }
 
 static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
@@ -45,42 +78,200 @@ static PangoLayout *create_text_layout(struct wd_head *head,
       gtk_style_context_get_path(style));
   gtk_widget_path_append_type(desc_path, G_TYPE_NONE);
   gtk_style_context_set_path(desc_style, desc_path);
+  gtk_widget_path_unref(desc_path);
   gtk_style_context_add_class(desc_style, "description");
 
   double desc_font_size = 16.;
   gtk_style_context_get(desc_style, GTK_STATE_FLAG_NORMAL,
       "font-size", &desc_font_size, NULL);
+  g_object_unref(desc_style);
+
+  PangoFontDescription *font = NULL;
+  gtk_style_context_get(style, GTK_STATE_FLAG_NORMAL, "font", &font, NULL);
 
   g_autofree gchar *str = g_strdup_printf("%s\n<span size=\"%d\">%s</span>",
       head->name, (int) (desc_font_size * PANGO_SCALE), head->description);
   PangoLayout *layout = pango_layout_new(pango);
+  pango_layout_set_font_description(layout, font);
+  pango_font_description_free(font);
 
   pango_layout_set_markup(layout, str, -1);
   return layout;
 }
 
+static void invalidate_text_layout(struct wd_output *output) {
+  g_clear_object(&output->overlay_layout);
+  g_clear_pointer(&output->overlay_description, g_free);
+  output->overlay_name = NULL;
+}
+
+static void style_changed(GtkStyleContext *style, gpointer data) {
+  struct wd_state *state = data;
+  struct wd_output *output;
+  wl_list_for_each(output, &state->outputs, link) {
+    if (output->overlay_layout != NULL) {
+      invalidate_text_layout(output);
+      wd_redraw_overlay(output);
+    }
+  }
+}
+
+/*
+ * Overlays are plain layer surfaces, so instead of a widget they share one
+ * style context for the .output-overlay class and one Pango context.
+ */
+static GtkStyleContext *get_overlay_style(struct wd_state *state) {
+  if (state->overlay_style == NULL) {
+    GtkWidgetPath *path = gtk_widget_path_new();
+    gtk_widget_path_append_type(path, GTK_TYPE_WINDOW);
+    gtk_widget_path_iter_add_class(path, -1, "output-overlay");
+    state->overlay_style = gtk_style_context_new();
+    gtk_style_context_set_screen(state->overlay_style,
+        gdk_screen_get_default());
+    gtk_style_context_set_path(state->overlay_style, path);
+    gtk_widget_path_unref(path);
+    g_signal_connect(state->overlay_style, "changed",
+        G_CALLBACK(style_changed), state);
+
+    state->overlay_pango = gdk_pango_context_get();
+  }
+  return state->overlay_style;
+}
+
+/*
+ * Returns the overlay text for the head, reusing the cached layout unless the
+ * head's identity, name or description changed since it was built.
+ */
+static PangoLayout *get_text_layout(struct wd_output *output,
+    struct wd_head *head) {
+  if (output->overlay_layout != NULL
+      && output->overlay_head_id == head->id
+      && output->overlay_name == head->name
+      && g_strcmp0(output->overlay_description, head->description) == 0) {
+    return output->overlay_layout;
+  }
+  invalidate_text_layout(output);
+  GtkStyleContext *style_ctx = get_overlay_style(output->state);
+  output->overlay_layout = create_text_layout(head,
+      output->state->overlay_pango, style_ctx);
+  output->overlay_head_id = head->id;
+  output->overlay_name = head->name;
+  output->overlay_description = g_strdup(head->description);
+  return output->overlay_layout;
+}
+
+/*
+ * Rasterises the cached text into a new shm buffer and attaches it. The text
+ * is only laid out again when it changed, so this is the whole cost of a
+ * redraw.
+ */
+static void draw_buffer(struct wd_output *output) {
+  WD_SPAN("overlay draw");
+  struct wd_head *head = wd_find_head(output->state, output);
+  if (head == NULL || output->overlay_configured_width == 0
+      || output->overlay_configured_height == 0) {
+    return;
+  }
+  int width = output->overlay_configured_width;
+  int height = output->overlay_configured_height;
+  int32_t scale = get_buffer_scale(output);
+  int buffer_width = width * scale;
+  int buffer_height = height * scale;
+  int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, buffer_width);
+  size_t size = stride * buffer_height;
+
+  int fd = wd_create_shm_file(size, "/wd-overlay-%s", output->name);
+  if (fd == -1) {
+    return;
+  }
+  void *pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (pixels == MAP_FAILED) {
+    fprintf(stderr, "mmap: %s\n", strerror(errno));
+    close(fd);
+    return;
+  }
+
+  GtkStyleContext *style_ctx = get_overlay_style(output->state);
+  PangoLayout *layout = get_text_layout(output, head);
+  GdkRGBA fg;
+  gtk_style_context_get_color(style_ctx, GTK_STATE_FLAG_NORMAL, &fg);
+  GtkBorder padding;
+  gtk_style_context_get_padding(style_ctx, GTK_STATE_FLAG_NORMAL, &padding);
+  double opacity = 1.;
+  gtk_style_context_get(style_ctx, GTK_STATE_FLAG_NORMAL,
+      "opacity", &opacity, NULL);
+
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(pixels,
+      CAIRO_FORMAT_ARGB32, buffer_width, buffer_height, stride);
+  cairo_surface_set_device_scale(surface, scale, scale);
+  cairo_t *cr = cairo_create(surface);
+  cairo_push_group(cr);
+  gtk_render_background(style_ctx, cr, 0, 0, width, height);
+  gdk_cairo_set_source_rgba(cr, &fg);
+  cairo_move_to(cr, padding.left, padding.top);
+  pango_cairo_show_layout(cr, layout);
+  cairo_pop_group_to_source(cr);
+  cairo_paint_with_alpha(cr, opacity);
+  cairo_destroy(cr);
+  cairo_surface_flush(surface);
+  cairo_surface_destroy(surface);
+  munmap(pixels, size);
+
+  struct wl_shm_pool *pool = wl_shm_create_pool(output->state->shm, fd, size);
+  struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0,
+      buffer_width, buffer_height, stride, WL_SHM_FORMAT_ARGB8888);
+  wl_shm_pool_destroy(pool);
+  close(fd);
+
+  if (scale != output->overlay_buffer_scale && wl_proxy_get_version(
+        (struct wl_proxy *) output->overlay_surface)
+      >= WL_SURFACE_SET_BUFFER_SCALE_SINCE_VERSION) {
+    wl_surface_set_buffer_scale(output->overlay_surface, scale);
+  }
+  wl_surface_attach(output->overlay_surface, buffer, 0, 0);
+  wl_surface_damage(output->overlay_surface, 0, 0, width, height);
+  wl_surface_commit(output->overlay_surface);
+  if (output->overlay_buffer != NULL) {
+    wl_buffer_destroy(output->overlay_buffer);
+  }
+  output->overlay_buffer = buffer;
+  output->overlay_buffer_width = width;
+  output->overlay_buffer_height = height;
+  output->overlay_buffer_scale = scale;
+}
+
+/*
+ * Requests a surface size that fits the text. The buffer is drawn when the
+ * compositor configures the new size, or right away if only the text or the
+ * scale changed.
+ */
 static void resize(struct wd_output *output) {
+  WD_SPAN("overlay resize");
   struct wd_head *head = wd_find_head(output->state, output);
+  if (head == NULL) {
+    return;
+  }
 
+  /* surface sizes are in logical pixels */
   uint32_t screen_width = head->custom_mode.width;
   uint32_t screen_height = head->custom_mode.height;
   if (head->mode != NULL) {
     screen_width = head->mode->width;
     screen_height = head->mode->height;
   }
+  if (head->scale > 0.) {
+    screen_width /= head->scale;
+    screen_height /= head->scale;
+  }
   uint32_t margin =  min(screen_width, screen_height) * SCREEN_MARGIN_PERCENT;
 
-  GdkWindow *window = gtk_widget_get_window(output->overlay_window);
-  PangoContext *pango = gtk_widget_get_pango_context(output->overlay_window);
-  GtkStyleContext *style_ctx = gtk_widget_get_style_context(
-      output->overlay_window);
-  PangoLayout *layout = create_text_layout(head, pango, style_ctx);
+  GtkStyleContext *style_ctx = get_overlay_style(output->state);
+  PangoLayout *cached = output->overlay_layout;
+  PangoLayout *layout = get_text_layout(output, head);
 
   int width;
   int height;
   pango_layout_get_pixel_size(layout, &width, &height);
-  g_object_unref(layout);
-
 
   GtkBorder padding;
   gtk_style_context_get_padding(style_ctx, GTK_STATE_FLAG_NORMAL, &padding);
@@ -90,42 +281,53 @@ static void resize(struct wd_output *output) {
   height = min(height, screen_height - margin * 2)
     + padding.top + padding.bottom;
 
-  zwlr_layer_surface_v1_set_margin(output->overlay_layer_surface,
-      margin, margin, margin, margin);
+  bool margin_changed = margin != output->overlay_margin;
+  if (margin_changed) {
+    zwlr_layer_surface_v1_set_margin(output->overlay_layer_surface,
+        margin, margin, margin, margin);
+    output->overlay_margin = margin;
+  }
+  if (output->overlay_configured
+      && (uint32_t) width == output->overlay_width
+      && (uint32_t) height == output->overlay_height) {
+    if (layout != cached
+        || get_buffer_scale(output) != output->overlay_buffer_scale) {
+      draw_buffer(output);
+    } else if (margin_changed) {
+      wl_surface_commit(output->overlay_surface);
+    }
+    return;
+  }
+  /* drawn when the compositor configures it, which may be a different size */
   zwlr_layer_surface_v1_set_size(output->overlay_layer_surface,
       width, height);
-
-  struct wl_surface *surface = gdk_wayland_window_get_wl_surface(window);
-  wl_surface_commit(surface);
-
-  GdkDisplay *display = gdk_window_get_display(window);
-  wl_display_roundtrip(gdk_wayland_display_get_wl_display(display));
+  output->overlay_width = width;
+  output->overlay_height = height;
+  wl_surface_commit(output->overlay_surface);
 }
 
 void wd_redraw_overlay(struct wd_output *output) {
-  if (output->overlay_window != NULL) {
+  if (output->overlay_surface != NULL) {
     resize(output);
-    gtk_widget_queue_draw(output->overlay_window);
   }
 }
 
-void window_realize(GtkWidget *widget, gpointer data) {
-  GdkWindow *window = gtk_widget_get_window(widget);
-  gdk_wayland_window_set_use_custom_surface(window);
-}
-
-void window_map(GtkWidget *widget, gpointer data) {
-  struct wd_output *output = data;
-
-  GdkWindow *window = gtk_widget_get_window(widget);
-  cairo_region_t *region = cairo_region_create();
-  gdk_window_input_shape_combine_region(window, region, 0, 0);
-  cairo_region_destroy(region);
+void wd_create_overlay(struct wd_output *output) {
+  struct wd_state *state = output->state;
+  if (output->overlay_surface != NULL || state->compositor == NULL
+      || state->layer_shell == NULL
+      || wd_find_head(state, output) == NULL) {
+    return;
+  }
+  output->overlay_surface = wl_compositor_create_surface(state->compositor);
 
-  struct wl_surface *surface = gdk_wayland_window_get_wl_surface(window);
+  /* let pointer input fall through to whatever is underneath */
+  struct wl_region *region = wl_compositor_create_region(state->compositor);
+  wl_surface_set_input_region(output->overlay_surface, region);
+  wl_region_destroy(region);
 
   output->overlay_layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-      output->state->layer_shell, surface, output->wl_output,
+      state->layer_shell, output->overlay_surface, output->wl_output,
       ZWLR_LAYER_SHELL_V1_LAYER_TOP, "output-overlay");
 
   zwlr_layer_surface_v1_add_listener(output->overlay_layer_surface,
@@ -138,59 +340,27 @@ void window_map(GtkWidget *widget, gpointer data) {
   resize(output);
 }
 
-void window_unmap(GtkWidget *widget, gpointer data) {
-  struct wd_output *output = data;
-  zwlr_layer_surface_v1_destroy(output->overlay_layer_surface);
-}
-
-gboolean window_draw(GtkWidget *widget, cairo_t *cr, gpointer data) {
-  struct wd_output *output = data;
-  struct wd_head *head = wd_find_head(output->state, output);
-
-  GtkStyleContext *style_ctx = gtk_widget_get_style_context(widget);
-  GdkRGBA fg;
-  gtk_style_context_get_color(style_ctx, GTK_STATE_FLAG_NORMAL, &fg);
-
-  int width = gtk_widget_get_allocated_width(widget);
-  int height = gtk_widget_get_allocated_height(widget);
-  gtk_render_background(style_ctx, cr, 0, 0, width, height);
-
-  GtkBorder padding;
-  gtk_style_context_get_padding(style_ctx, GTK_STATE_FLAG_NORMAL, &padding);
-  PangoContext *pango = gtk_widget_get_pango_context(widget);
-  PangoLayout *layout = create_text_layout(head, pango, style_ctx);
-
-  gdk_cairo_set_source_rgba(cr, &fg);
-  cairo_move_to(cr, padding.left, padding.top);
-  pango_cairo_show_layout(cr, layout);
-  g_object_unref(layout);
-  return TRUE;
-}
-
-void wd_create_overlay(struct wd_output *output) {
-  output->overlay_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-  gtk_window_set_decorated(GTK_WINDOW(output->overlay_window), FALSE);
-  gtk_window_set_resizable(GTK_WINDOW(output->overlay_window), FALSE);
-  gtk_widget_add_events(output->overlay_window, GDK_STRUCTURE_MASK);
-
-  g_signal_connect(output->overlay_window, "realize",
-      G_CALLBACK(window_realize), output);
-  g_signal_connect(output->overlay_window, "map",
-      G_CALLBACK(window_map), output);
-  g_signal_connect(output->overlay_window, "unmap",
-      G_CALLBACK(window_unmap), output);
-  g_signal_connect(output->overlay_window, "draw",
-      G_CALLBACK(window_draw), output);
-
-  GtkStyleContext *style_ctx = gtk_widget_get_style_context(
-      output->overlay_window);
-  gtk_style_context_add_class(style_ctx, "output-overlay");
-  gtk_widget_show(output->overlay_window);
-}
-
 void wd_destroy_overlay(struct wd_output *output) {
-  if (output->overlay_window != NULL) {
-    gtk_widget_destroy(output->overlay_window);
-    output->overlay_window = NULL;
+  if (output->overlay_layer_surface != NULL) {
+    zwlr_layer_surface_v1_destroy(output->overlay_layer_surface);
+    output->overlay_layer_surface = NULL;
+  }
+  if (output->overlay_surface != NULL) {
+    wl_surface_destroy(output->overlay_surface);
+    output->overlay_surface = NULL;
+  }
+  if (output->overlay_buffer != NULL) {
+    wl_buffer_destroy(output->overlay_buffer);
+    output->overlay_buffer = NULL;
   }
+  output->overlay_configured = false;
+  output->overlay_width = 0;
+  output->overlay_height = 0;
+  output->overlay_configured_width = 0;
+  output->overlay_configured_height = 0;
+  output->overlay_buffer_width = 0;
+  output->overlay_buffer_height = 0;
+  output->overlay_buffer_scale = 0;
+  output->overlay_margin = 0;
+  invalidate_text_layout(output);
 }
@@ -0,0 +1,63 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Span instrumentation of the hot paths, written as Chrome trace events so the
+ * result opens in chrome://tracing or Perfetto. Only built with
+ * -Dprofiling=true.
+ */
+
+#include "wdisplays.h"
+
+#ifdef WDISPLAYS_PROFILING
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <glib.h>
+
+static FILE *profile_file;
+static unsigned profile_events;
+
+bool wd_profile_start(const char *path) {
+  profile_file = fopen(path, "w");
+  if (profile_file == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  profile_events = 0;
+  fputs("{\"traceEvents\":[", profile_file);
+  return true;
+}
+
+void wd_profile_stop(void) {
+  if (profile_file == NULL)
+    return;
+  fputs("\n],\"displayTimeUnit\":\"ms\"}\n", profile_file);
+  fclose(profile_file);
+  profile_file = NULL;
+  g_debug("profile: %u spans written", profile_events);
+}
+
+struct wd_span wd_span_begin(const char *name) {
+  struct wd_span span = { .name = name };
+  if (profile_file != NULL)
+    span.start = g_get_monotonic_time();
+  return span;
+}
+
+void wd_span_end(struct wd_span *span) {
+  if (profile_file == NULL || span->start == 0)
+    return;
+  uint64_t end = g_get_monotonic_time();
+  /* span names are string literals, so they need no escaping */
+  fprintf(profile_file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" G_GUINT64_FORMAT
+      ",\"dur\":%" G_GUINT64_FORMAT ",\"pid\":%d,\"tid\":1}",
+      profile_events++ > 0 ? "," : "", span->name, span->start,
+      end - span->start, (int) getpid());
+}
+
+#endif
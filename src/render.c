@@ -5,6 +5,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <epoxy/gl.h>
 #include <wayland-util.h>
@@ -50,6 +51,7 @@ struct wd_gl_data {
 
   unsigned texture_count;
   GLuint textures[HEADS_MAX];
+  size_t texture_bytes[HEADS_MAX];
 
   float verts[BT_LINE_MAX];
 };
@@ -249,6 +251,7 @@ static inline float ease(float d) {
 
 void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
     uint64_t tick) {
+  WD_SPAN("wd_gl_render");
   unsigned int tri_verts = 0;
 
   unsigned int head_count = wl_list_length(&info->heads);
@@ -324,6 +327,7 @@ void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
     glBindBuffer(GL_ARRAY_BUFFER, res->buffers[TEXTURE_BUFFER]);
     glBufferSubData(GL_ARRAY_BUFFER, 0,
         tri_verts * BT_UV_VERT_SIZE * sizeof(float), res->verts);
+    info->stats.upload_bytes += tri_verts * BT_UV_VERT_SIZE * sizeof(float);
     glEnableVertexAttribArray(res->texture_position_attribute);
     glEnableVertexAttribArray(res->texture_uv_attribute);
     glVertexAttribPointer(res->texture_position_attribute,
@@ -344,7 +348,15 @@ void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
             head->tex_width, head->tex_height,
             0, GL_RGBA, GL_UNSIGNED_BYTE, head->pixels);
         glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+        info->stats.upload_bytes += (uint64_t) head->tex_stride
+          * head->tex_height;
+        info->stats.texture_uploads++;
         glGenerateMipmap(GL_TEXTURE_2D);
+        /* specifying the image again frees the previous storage */
+        info->texture_bytes -= res->texture_bytes[i];
+        res->texture_bytes[i] = wd_gl_texture_bytes(head->tex_width,
+            head->tex_height);
+        info->texture_bytes += res->texture_bytes[i];
       }
       glUniformMatrix4fv(res->texture_color_transform_uniform, 1, GL_FALSE,
         head->swap_rgb ? TRANSFORM_RGB : TRANSFORM_BGR);
@@ -400,6 +412,7 @@ void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
     glBindBuffer(GL_ARRAY_BUFFER, res->buffers[COLOR_BUFFER]);
     glBufferSubData(GL_ARRAY_BUFFER, 0,
         tri_verts * BT_COLOR_VERT_SIZE * sizeof(float), res->verts);
+    info->stats.upload_bytes += tri_verts * BT_COLOR_VERT_SIZE * sizeof(float);
     glEnableVertexAttribArray(res->color_position_attribute);
     glEnableVertexAttribArray(res->color_color_attribute);
     glVertexAttribPointer(res->color_position_attribute, 2, GL_FLOAT, GL_FALSE,
@@ -500,6 +513,7 @@ void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
     glBindBuffer(GL_ARRAY_BUFFER, res->buffers[LINE_BUFFER]);
     glBufferSubData(GL_ARRAY_BUFFER, 0,
         line_verts * BT_LINE_VERT_SIZE * sizeof(float), res->verts);
+    info->stats.upload_bytes += line_verts * BT_LINE_VERT_SIZE * sizeof(float);
     glEnableVertexAttribArray(res->color_position_attribute);
     glEnableVertexAttribArray(res->color_color_attribute);
     glVertexAttribPointer(res->color_position_attribute, 2, GL_FLOAT, GL_FALSE,
@@ -512,7 +526,38 @@ void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info,
   }
 }
 
+static int compare_usecs(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+  return (x > y) - (x < y);
+}
+
+uint32_t wd_render_stats_percentile(const struct wd_render_stats *stats,
+    double fraction) {
+  size_t n = stats->frames < RENDER_STAT_SAMPLES
+    ? stats->frames : RENDER_STAT_SAMPLES;
+  if (n == 0)
+    return 0;
+  uint32_t sorted[RENDER_STAT_SAMPLES];
+  memcpy(sorted, stats->frame_usecs, n * sizeof(*sorted));
+  qsort(sorted, n, sizeof(*sorted), compare_usecs);
+  size_t i = fraction * (n - 1) + .5;
+  return sorted[i < n ? i : n - 1];
+}
+
+size_t wd_gl_texture_bytes(unsigned width, unsigned height) {
+  size_t bytes = 0;
+  for (;;) {
+    bytes += (size_t) width * height * 4;
+    if (width <= 1 && height <= 1)
+      return bytes;
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+}
+
 void wd_gl_cleanup(struct wd_gl_data *res) {
+  glDeleteTextures(res->texture_count, res->textures);
   glDeleteBuffers(NUM_BUFFERS, res->buffers);
   glDeleteShader(res->texture_fragment_shader);
   glDeleteShader(res->texture_vertex_shader);
@@ -0,0 +1,507 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Recording and replay of the protocol events wdisplays receives.
+ *
+ * While recording, every proxy that outputs.c listens to gets a dispatcher
+ * instead of a plain listener. The dispatcher writes the event to the trace
+ * and then calls the listener as libwayland would.
+ *
+ * Replay connects to a socket nobody serves, so requests the listeners make
+ * go nowhere, and feeds the recorded events to the listeners of matching
+ * proxies. Objects the client creates itself are matched up by the order in
+ * which it creates them, which is deterministic given the same events.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <wayland-client.h>
+
+#include "wdisplays.h"
+
+#include "wlr-output-management-unstable-v1-client-protocol.h"
+#include "xdg-output-unstable-v1-client-protocol.h"
+#include "wlr-screencopy-unstable-v1-client-protocol.h"
+
+#define TRACE_MAGIC "WDTRACE\1"
+#define TRACE_ARGS_MAX 8
+
+enum trace_kind {
+  TRACE_EVENT,
+  TRACE_CREATE, // the client added a listener to a new object
+  TRACE_ADD_OUTPUT, // wd_add_output with a wl_output from GDK
+  TRACE_REMOVE_OUTPUT,
+  TRACE_CAPTURE, // wd_capture_frame started captures
+};
+
+static const struct wl_interface *const trace_interfaces[] = {
+  &wl_registry_interface,
+  &zwlr_output_manager_v1_interface,
+  &zwlr_output_head_v1_interface,
+  &zwlr_output_mode_v1_interface,
+  &zwlr_output_configuration_v1_interface,
+  &zxdg_output_v1_interface,
+  &zwlr_screencopy_frame_v1_interface,
+  &wl_output_interface,
+};
+
+#define TRACE_INTERFACES G_N_ELEMENTS(trace_interfaces)
+
+struct trace_record {
+  uint64_t usecs; // since the start of the recording
+  uint32_t id;
+  uint8_t kind;
+  uint8_t iface;
+  uint16_t opcode;
+};
+
+static struct {
+  FILE *file;
+  gint64 start;
+} recording;
+
+static struct {
+  bool active;
+  GQueue created[TRACE_INTERFACES]; // proxies not yet matched to a record
+} replay;
+
+static int interface_index(const struct wl_interface *interface) {
+  for (size_t i = 0; i < TRACE_INTERFACES; i++) {
+    if (trace_interfaces[i] == interface
+        || strcmp(trace_interfaces[i]->name, interface->name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int proxy_interface_index(struct wl_proxy *proxy) {
+  const char *class = wl_proxy_get_class(proxy);
+  for (size_t i = 0; i < TRACE_INTERFACES; i++) {
+    if (strcmp(trace_interfaces[i]->name, class) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Reduces a message signature to one character per argument: u for 32 bit
+ * values, s for strings, o for objects, n for new ids and a for arrays.
+ */
+static size_t canonical_signature(const struct wl_message *message,
+    char sig[static TRACE_ARGS_MAX + 1]) {
+  size_t n = 0;
+  for (const char *c = message->signature; *c != '\0'; c++) {
+    char type;
+    switch (*c) {
+    case 'i': case 'u': case 'f': case 'h': type = 'u'; break;
+    case 's': type = 's'; break;
+    case 'o': type = 'o'; break;
+    case 'n': type = 'n'; break;
+    case 'a': type = 'a'; break;
+    default: continue; // version and nullability markers
+    }
+    if (n == TRACE_ARGS_MAX) {
+      break;
+    }
+    sig[n++] = type;
+  }
+  sig[n] = '\0';
+  return n;
+}
+
+typedef void (*listener_func)(void);
+
+/*
+ * Calls a listener the way libwayland does, for the signatures used by the
+ * interfaces that are traced.
+ */
+static void invoke_listener(const void *implementation, struct wl_proxy *proxy,
+    uint32_t opcode, const struct wl_message *message,
+    union wl_argument *args) {
+  listener_func func = ((const listener_func *) implementation)[opcode];
+  if (func == NULL) {
+    return;
+  }
+  void *data = wl_proxy_get_user_data(proxy);
+  char sig[TRACE_ARGS_MAX + 1];
+  size_t n = canonical_signature(message, sig);
+  for (size_t i = 0; i < n; i++) {
+    if (sig[i] == 'n') {
+      sig[i] = 'o';
+    }
+  }
+
+  if (strcmp(sig, "") == 0) {
+    ((void (*)(void *, struct wl_proxy *)) func)(data, proxy);
+  } else if (strcmp(sig, "u") == 0) {
+    ((void (*)(void *, struct wl_proxy *, uint32_t)) func)(data, proxy,
+        args[0].u);
+  } else if (strcmp(sig, "uu") == 0) {
+    ((void (*)(void *, struct wl_proxy *, uint32_t, uint32_t)) func)(data,
+        proxy, args[0].u, args[1].u);
+  } else if (strcmp(sig, "uuu") == 0) {
+    ((void (*)(void *, struct wl_proxy *, uint32_t, uint32_t, uint32_t)) func)(
+        data, proxy, args[0].u, args[1].u, args[2].u);
+  } else if (strcmp(sig, "uuuu") == 0) {
+    ((void (*)(void *, struct wl_proxy *, uint32_t, uint32_t, uint32_t,
+        uint32_t)) func)(data, proxy, args[0].u, args[1].u, args[2].u,
+        args[3].u);
+  } else if (strcmp(sig, "s") == 0) {
+    ((void (*)(void *, struct wl_proxy *, const char *)) func)(data, proxy,
+        args[0].s);
+  } else if (strcmp(sig, "o") == 0) {
+    ((void (*)(void *, struct wl_proxy *, void *)) func)(data, proxy,
+        args[0].o);
+  } else if (strcmp(sig, "usu") == 0) {
+    ((void (*)(void *, struct wl_proxy *, uint32_t, const char *,
+        uint32_t)) func)(data, proxy, args[0].u, args[1].s, args[2].u);
+  } else {
+    fprintf(stderr, "trace: can't dispatch %s.%s\n",
+        wl_proxy_get_class(proxy), message->name);
+  }
+}
+
+static void write_u32(uint32_t value) {
+  fwrite(&value, sizeof(value), 1, recording.file);
+}
+
+static void write_record(enum trace_kind kind, int iface, uint32_t id,
+    uint16_t opcode) {
+  struct trace_record record = {
+    .usecs = g_get_monotonic_time() - recording.start,
+    .id = id,
+    .kind = kind,
+    .iface = iface,
+    .opcode = opcode,
+  };
+  fwrite(&record.usecs, sizeof(record.usecs), 1, recording.file);
+  write_u32(record.id);
+  fwrite(&record.kind, sizeof(record.kind), 1, recording.file);
+  fwrite(&record.iface, sizeof(record.iface), 1, recording.file);
+  fwrite(&record.opcode, sizeof(record.opcode), 1, recording.file);
+}
+
+static int trace_dispatch(const void *implementation, void *target,
+    uint32_t opcode, const struct wl_message *message,
+    union wl_argument *args) {
+  struct wl_proxy *proxy = target;
+  int iface = proxy_interface_index(proxy);
+  write_record(TRACE_EVENT, iface, wl_proxy_get_id(proxy), opcode);
+
+  char sig[TRACE_ARGS_MAX + 1];
+  size_t n = canonical_signature(message, sig);
+  for (size_t i = 0; i < n; i++) {
+    switch (sig[i]) {
+    case 'u':
+      write_u32(args[i].u);
+      break;
+    case 's':;
+      uint32_t len = args[i].s != NULL ? strlen(args[i].s) + 1 : 0;
+      write_u32(len);
+      fwrite(args[i].s, 1, len, recording.file);
+      break;
+    case 'o':
+    case 'n':
+      write_u32(args[i].o != NULL ? wl_proxy_get_id(args[i].o) : 0);
+      break;
+    case 'a':
+      write_u32(args[i].a->size);
+      fwrite(args[i].a->data, 1, args[i].a->size, recording.file);
+      break;
+    }
+  }
+
+  invoke_listener(implementation, proxy, opcode, message, args);
+  return 0;
+}
+
+bool wd_trace_start(const char *path) {
+  recording.file = fopen(path, "wb");
+  if (recording.file == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), recording.file);
+  recording.start = g_get_monotonic_time();
+  return true;
+}
+
+void wd_trace_stop(void) {
+  if (recording.file != NULL) {
+    fclose(recording.file);
+    recording.file = NULL;
+  }
+}
+
+void wd_proxy_add_listener(struct wl_proxy *proxy, const void *listener,
+    void *data) {
+  int iface = proxy_interface_index(proxy);
+  if (recording.file != NULL && iface != -1) {
+    write_record(TRACE_CREATE, iface, wl_proxy_get_id(proxy), 0);
+    wl_proxy_add_dispatcher(proxy, trace_dispatch, listener, data);
+    return;
+  }
+  wl_proxy_add_listener(proxy, (void (**)(void)) listener, data);
+  if (replay.active && iface != -1) {
+    g_queue_push_tail(&replay.created[iface], proxy);
+  }
+}
+
+void wd_trace_output(bool added, struct wl_output *wl_output) {
+  if (recording.file != NULL) {
+    write_record(added ? TRACE_ADD_OUTPUT : TRACE_REMOVE_OUTPUT,
+        interface_index(&wl_output_interface),
+        wl_proxy_get_id((struct wl_proxy *) wl_output), 0);
+  }
+}
+
+void wd_trace_capture(void) {
+  if (recording.file != NULL) {
+    write_record(TRACE_CAPTURE, 0, 0, 0);
+  }
+}
+
+// BEGIN REPLAY
+
+/*
+ * Throws away everything the client sends, including file descriptors, so
+ * the socket never fills up.
+ */
+static void drain_socket(int fd) {
+  char buf[4096];
+  char control[CMSG_SPACE(sizeof(int) * 28)];
+  for (;;) {
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+    };
+    ssize_t len = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (len <= 0) {
+      return;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+        cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        int *fds = (int *) CMSG_DATA(cmsg);
+        size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < n; i++) {
+          close(fds[i]);
+        }
+      }
+    }
+  }
+}
+
+static bool read_exact(FILE *file, void *buf, size_t size) {
+  return fread(buf, 1, size, file) == size;
+}
+
+static bool read_record(FILE *file, struct trace_record *record) {
+  return read_exact(file, &record->usecs, sizeof(record->usecs))
+    && read_exact(file, &record->id, sizeof(record->id))
+    && read_exact(file, &record->kind, sizeof(record->kind))
+    && read_exact(file, &record->iface, sizeof(record->iface))
+    && read_exact(file, &record->opcode, sizeof(record->opcode));
+}
+
+struct replay_event {
+  union wl_argument args[TRACE_ARGS_MAX];
+  char *strings[TRACE_ARGS_MAX];
+  struct wl_array arrays[TRACE_ARGS_MAX];
+};
+
+static void replay_event_finish(struct replay_event *event) {
+  for (size_t i = 0; i < TRACE_ARGS_MAX; i++) {
+    free(event->strings[i]);
+    wl_array_release(&event->arrays[i]);
+  }
+}
+
+/*
+ * Reads the arguments of an event and maps recorded object ids to replay
+ * proxies, creating the proxies for new ids.
+ */
+static bool read_event_args(FILE *file, struct wl_proxy *target,
+    const struct wl_message *message, GHashTable *objects,
+    struct replay_event *event) {
+  char sig[TRACE_ARGS_MAX + 1];
+  size_t n = canonical_signature(message, sig);
+  for (size_t i = 0; i < n; i++) {
+    uint32_t value;
+    if (!read_exact(file, &value, sizeof(value))) {
+      return false;
+    }
+    switch (sig[i]) {
+    case 'u':
+      event->args[i].u = value;
+      break;
+    case 's':
+      if (value > 0) {
+        event->strings[i] = malloc(value);
+        if (!read_exact(file, event->strings[i], value)) {
+          return false;
+        }
+        event->strings[i][value - 1] = '\0';
+      }
+      event->args[i].s = event->strings[i];
+      break;
+    case 'a':
+      if (!read_exact(file, wl_array_add(&event->arrays[i], value), value)) {
+        return false;
+      }
+      event->args[i].a = &event->arrays[i];
+      break;
+    case 'n':
+      /* ids are reused once objects are gone, so a new id always replaces
+       * whatever it mapped to before */
+      if (target != NULL && value != 0) {
+        struct wl_proxy *proxy = wl_proxy_create(target, message->types[i]);
+        g_hash_table_insert(objects, GUINT_TO_POINTER(value), proxy);
+      }
+      /* fallthrough */
+    case 'o':
+      event->args[i].o = g_hash_table_lookup(objects, GUINT_TO_POINTER(value));
+      break;
+    }
+  }
+  return true;
+}
+
+int wd_trace_replay(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  char magic[sizeof(TRACE_MAGIC) - 1];
+  if (!read_exact(file, magic, sizeof(magic))
+      || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "%s: not a wdisplays trace\n", path);
+    fclose(file);
+    return 1;
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+    fprintf(stderr, "socketpair: %s\n", strerror(errno));
+    fclose(file);
+    return 1;
+  }
+  struct wl_display *display = wl_display_connect_to_fd(fds[0]);
+
+  replay.active = true;
+  for (size_t i = 0; i < TRACE_INTERFACES; i++) {
+    g_queue_init(&replay.created[i]);
+  }
+  GHashTable *objects = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  struct wd_state *state = wd_state_create();
+  state->show_overlay = false;
+  struct wl_registry *registry = wd_listen_registry(state, display);
+
+  unsigned long events = 0, skipped = 0;
+  uint64_t recorded_usecs = 0;
+  gint64 begin = g_get_monotonic_time();
+  struct trace_record record;
+  bool ok = true;
+  while (ok && read_record(file, &record)) {
+    recorded_usecs = record.usecs;
+    if (record.iface >= TRACE_INTERFACES) {
+      fprintf(stderr, "%s: corrupt record\n", path);
+      ok = false;
+      break;
+    }
+    const struct wl_interface *interface = trace_interfaces[record.iface];
+    switch (record.kind) {
+    case TRACE_CREATE:;
+      struct wl_proxy *created = g_queue_pop_head(&replay.created[record.iface]);
+      if (created != NULL) {
+        g_hash_table_insert(objects, GUINT_TO_POINTER(record.id), created);
+      }
+      break;
+    case TRACE_ADD_OUTPUT:;
+      struct wl_output *wl_output = wl_registry_bind(registry, 0,
+          &wl_output_interface, 1);
+      g_hash_table_insert(objects, GUINT_TO_POINTER(record.id), wl_output);
+      wd_add_output(state, wl_output);
+      break;
+    case TRACE_REMOVE_OUTPUT:;
+      struct wl_output *removed = g_hash_table_lookup(objects,
+          GUINT_TO_POINTER(record.id));
+      if (removed != NULL) {
+        wd_remove_output(state, removed);
+        g_hash_table_remove(objects, GUINT_TO_POINTER(record.id));
+        wl_output_destroy(removed);
+      }
+      break;
+    case TRACE_CAPTURE:
+      wd_capture_frame(state);
+      break;
+    case TRACE_EVENT:;
+      if (record.opcode >= interface->event_count) {
+        fprintf(stderr, "%s: corrupt record\n", path);
+        ok = false;
+        break;
+      }
+      const struct wl_message *message = &interface->events[record.opcode];
+      struct wl_proxy *target = g_hash_table_lookup(objects,
+          GUINT_TO_POINTER(record.id));
+      struct replay_event event = {0};
+      for (size_t i = 0; i < TRACE_ARGS_MAX; i++) {
+        wl_array_init(&event.arrays[i]);
+      }
+      /* the arguments are read even for objects the replay doesn't have,
+       * such as configurations made from the UI, to stay in sync */
+      if (!read_event_args(file, target, message, objects, &event)) {
+        fprintf(stderr, "%s: truncated record\n", path);
+        ok = false;
+      } else if (target == NULL || wl_proxy_get_listener(target) == NULL) {
+        skipped++;
+      } else {
+        invoke_listener(wl_proxy_get_listener(target), target, record.opcode,
+            message, event.args);
+        events++;
+      }
+      replay_event_finish(&event);
+      break;
+    }
+    wl_display_flush(display);
+    drain_socket(fds[1]);
+  }
+  gint64 elapsed = g_get_monotonic_time() - begin;
+
+  printf("replayed %lu events (%lu skipped) recorded over %.1fms in %.1fms\n",
+      events, skipped, recorded_usecs / 1000., elapsed / 1000.);
+  printf("%d heads, %d outputs, %" G_GUINT64_FORMAT " arena allocs, "
+      "%" G_GUINT64_FORMAT " reuses\n",
+      wl_list_length(&state->heads), wl_list_length(&state->outputs),
+      state->alloc_stats.arena_allocs, state->alloc_stats.arena_reuses);
+
+  wd_state_destroy(state);
+  wl_registry_destroy(registry);
+  g_hash_table_destroy(objects);
+  for (size_t i = 0; i < TRACE_INTERFACES; i++) {
+    g_queue_clear(&replay.created[i]);
+  }
+  replay.active = false;
+  wl_display_flush(display);
+  drain_socket(fds[1]);
+  wl_display_disconnect(display);
+  close(fds[1]);
+  fclose(file);
+  return ok ? 0 : 1;
+}
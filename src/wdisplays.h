@@ -21,6 +21,7 @@
 #include <wayland-client.h>
 
 #include "headform.h"
+#include "layout.h"
 
 struct zxdg_output_v1;
 struct zxdg_output_manager_v1;
@@ -40,6 +41,8 @@ struct _GdkCursor;
 typedef struct _GdkCursor GdkCursor;
 struct _cairo_surface;
 typedef struct _cairo_surface cairo_surface_t;
+struct _GHashTable;
+typedef struct _GHashTable GHashTable;
 
 struct wd_output {
   struct wd_state *state;
@@ -47,10 +50,27 @@ struct wd_output {
   struct wl_output *wl_output;
   struct wl_list link;
 
-  char *name;
+  const char *name; // interned
+  enum wd_head_fields dirty; // changed since the last xdg-output done event
   struct wl_list frames;
-  GtkWidget *overlay_window;
+  uint64_t capture_latency; // usecs from request to ready of the last frame
+  uint64_t viewed_at; // tick the head was last visible on the canvas
+  bool preview_released; // not captured until it is visible again
+  struct wl_surface *overlay_surface;
   struct zwlr_layer_surface_v1 *overlay_layer_surface;
+  struct wl_buffer *overlay_buffer;
+  uint32_t overlay_width, overlay_height; // requested surface size
+  uint32_t overlay_configured_width, overlay_configured_height; // last acked
+  uint32_t overlay_buffer_width, overlay_buffer_height; // attached, unscaled
+  int32_t overlay_buffer_scale;
+  uint32_t overlay_margin;
+  bool overlay_configured;
+
+  /* overlay text, laid out again only when what it shows changes */
+  PangoLayout *overlay_layout;
+  uint32_t overlay_head_id;
+  const char *overlay_name; // interned
+  char *overlay_description;
 };
 
 struct wd_frame {
@@ -66,10 +86,18 @@ struct wd_frame {
   struct wl_buffer *buffer;
   uint8_t *pixels;
   uint64_t tick;
+  uint64_t requested_at; // monotonic usecs
   bool y_invert;
   bool swap_rgb;
 };
 
+enum wd_test_result {
+  WD_TEST_PENDING,
+  WD_TEST_SUCCEEDED,
+  WD_TEST_FAILED,
+  WD_TEST_CANCELLED,
+};
+
 struct wd_head_config {
   struct wl_list link;
 
@@ -94,19 +122,112 @@ struct wd_mode {
   bool preferred;
 };
 
+struct wd_mode_entry {
+  int64_t key; // packed size and refresh, used as the index key
+  int32_t width, height;
+  int32_t refresh; // mHz
+  bool preferred;
+};
+
+/*
+ * The modes of a head sorted from largest to smallest, with duplicates
+ * removed, and indexed by size and refresh rate. Tables are immutable and
+ * interned by contents, so heads advertising the same modes share one table
+ * and comparing their mode lists is a pointer comparison.
+ */
+struct wd_mode_table {
+  unsigned refs;
+  unsigned hash;
+  size_t len;
+  struct wd_mode_entry *entries;
+  GHashTable *index;
+};
+
+struct wd_arena_block;
+
+/*
+ * Bump allocator for records that share a lifetime. Nothing is freed
+ * individually; all blocks are released together.
+ */
+struct wd_arena {
+  struct wd_arena_block *blocks;
+  size_t used; // bytes used in the first block
+};
+
+struct wd_alloc_stats {
+  uint64_t arena_allocs; // records and strings served from arenas
+  uint64_t arena_reuses; // records recycled from a free list
+  uint64_t block_allocs; // blocks obtained from malloc
+  uint64_t block_frees;
+  size_t block_bytes; // currently held in arena blocks
+};
+
+enum wd_memory_category {
+  WD_MEMORY_FRAMES, // screencopy shm buffers
+  WD_MEMORY_TEXTURES, // storage of the canvas textures and their mipmaps
+  WD_MEMORY_LABELS, // cairo surfaces of the heads' name labels
+  WD_MEMORY_CATEGORIES
+};
+
+extern const char *const wd_memory_category_names[WD_MEMORY_CATEGORIES];
+
+/*
+ * Bytes held for previews. Over budget, the previews of the outputs viewed
+ * least recently are released and not captured until they are visible again.
+ * Visible previews are never released or downscaled, so with enough of them in
+ * view the budget is exceeded.
+ */
+struct wd_memory {
+  size_t bytes[WD_MEMORY_CATEGORIES];
+  size_t budget; // 0 for no limit
+  uint64_t releases;
+  bool over_budget; // nothing is left to release
+};
+
+#define METRICS_LATENCY_BUCKETS 8
+
+/*
+ * Apply and capture health, exported for monitoring. Latency bucket i counts
+ * applies that took at most wd_metrics_latency_bounds[i] seconds.
+ */
+struct wd_metrics {
+  char *path; // textfile written periodically, NULL when not exporting
+  unsigned int timeout;
+
+  uint64_t apply_attempts; // configurations submitted, including retries
+  uint64_t apply_successes;
+  uint64_t apply_failures;
+  uint64_t apply_cancellations;
+  uint64_t apply_latency_buckets[METRICS_LATENCY_BUCKETS];
+  uint64_t apply_latency_count;
+  uint64_t apply_latency_sum; // usecs
+  uint64_t capture_failures;
+};
+
+extern const double wd_metrics_latency_bounds[METRICS_LATENCY_BUCKETS];
+
 struct wd_head {
   struct wd_state *state;
+  struct wd_arena arena; // owns this head, its modes and its strings
   struct zwlr_output_head_v1 *wlr_head;
   struct wl_list link;
 
   struct wd_output *output;
   struct wd_render_head_data *render;
   cairo_surface_t *surface;
-
-  uint32_t id;
-  char *name, *description;
+  GtkWidget *form;
+  struct wd_rect canvas_rect; // logical bounds as shown in the form
+  bool in_canvas; // counted in the canvas extent
+  bool changed; // the form differs from the head, counted in changed_heads
+
+  uint32_t id; // stable for the lifetime of the head
+  const char *name; // interned
+  char *description; // allocated from the arena
   int32_t phys_width, phys_height; // mm
   struct wl_list modes;
+  struct wl_list free_modes; // finished modes, reused for new ones
+  struct wd_mode_table *mode_table;
+  struct wd_mode **table_modes; // this head's mode for each table entry
 
   bool enabled;
   struct wd_mode *mode;
@@ -117,9 +238,13 @@ struct wd_head {
   int32_t x, y;
   enum wl_output_transform transform;
   double scale;
+
+  enum wd_head_fields dirty; // changed since the last done event
+  enum wd_head_fields ui_dirty; // not yet reflected on the canvas
 };
 
 struct wd_gl_data;
+struct wd_pending_config;
 
 struct wd_render_head_flags {
   uint8_t rotation;
@@ -152,6 +277,26 @@ struct wd_render_head_data {
   bool clicked;
 };
 
+#define RENDER_STAT_SAMPLES 256
+
+/*
+ * Cost of the canvas render path. Frame times are a ring buffer of the last
+ * RENDER_STAT_SAMPLES canvas renders, in usecs of the GTK thread's CPU time
+ * from the start of the render signal handler until wd_gl_render has
+ * submitted, so capture requests and label drawing are included but waits for
+ * the GPU are not; upload_bytes counts texture and vertex data sent to GL.
+ * Skipped frames are refresh cycles missed while the canvas redraws
+ * continuously.
+ */
+struct wd_render_stats {
+  uint64_t frames;
+  uint64_t upload_bytes;
+  uint64_t texture_uploads;
+  uint64_t skipped_frames;
+  uint64_t last_tick;
+  uint32_t frame_usecs[RENDER_STAT_SAMPLES];
+};
+
 struct wd_render_data {
   float fg_color[4];
   float bg_color[4];
@@ -166,35 +311,57 @@ struct wd_render_data {
   int x_origin;
   int y_origin;
   uint64_t updated_at;
+  struct wd_render_stats stats;
+  size_t texture_bytes; // texture storage allocated in GL
 
   struct wl_list heads;
 };
 
-struct wd_point {
-  double x;
-  double y;
-};
-
 struct wd_state {
   struct zxdg_output_manager_v1 *xdg_output_manager;
   struct zwlr_output_manager_v1 *output_manager;
   struct zwlr_screencopy_manager_v1 *copy_manager;
   struct zwlr_layer_shell_v1 *layer_shell;
   struct wl_shm *shm;
+  struct wl_compositor *compositor;
   struct wl_list heads;
   struct wl_list outputs;
+  GHashTable *heads_by_name;
+  GHashTable *outputs_by_name;
+  GHashTable *mode_tables; // set of interned struct wd_mode_table
+  struct wd_alloc_stats alloc_stats;
+  struct wd_metrics metrics;
+  struct wd_memory memory;
+  uint64_t head_ids; // bit set for each small head id in use
+  uint64_t released_head_ids; // freed since the last done event
+  uint32_t next_head_id; // past the bits of head_ids
   uint32_t serial;
 
   bool apply_pending;
+  struct wd_pending_config *apply_inflight;
+  bool apply_retry;
+  bool apply_queued;
+  uint64_t apply_latency; // usecs from apply to the compositor's reply
+  uint32_t test_serial;
+  enum wd_test_result test_result; // of the latest test
+  bool test_retry; // the latest test was cancelled, retest on the next done
+  /* called on each done event, before the heads' dirty fields are cleared */
+  void (*done_hook)(struct wd_state *state);
   bool autoapply;
   bool capture;
   bool show_overlay;
+  bool show_hud;
   double zoom;
 
   unsigned int apply_idle;
   unsigned int reset_idle;
+  unsigned int ui_idle;
+  unsigned int test_timeout;
+  unsigned int hud_timeout;
 
   struct wd_render_head_data *clicked;
+  struct wd_head *drag_head; // owner of clicked
+  GArray *snap_boxes; // the other heads, which stay put during a drag
   struct wd_point drag_start;
   struct wd_point head_drag_start; /* 0-1 range in head rect */
   bool panning;
@@ -211,9 +378,19 @@ struct wd_state {
   GtkWidget *zoom_reset;
   GtkWidget *zoom_in;
   GtkWidget *overlay;
+  GtkWidget *hud;
+  /* counters as of the last HUD update, for per-second rates */
+  uint64_t hud_time;
+  uint64_t hud_frames;
+  uint64_t hud_upload_bytes;
+  /* shared by the overlays, which have no widgets of their own */
+  PangoContext *overlay_pango;
+  GtkStyleContext *overlay_style;
   GtkWidget *info_bar;
   GtkWidget *info_label;
   GtkWidget *menu_button;
+  GtkWidget *apply_title;
+  GtkWidget *apply_button;
 
   GdkCursor *grab_cursor;
   GdkCursor *grabbing_cursor;
@@ -222,6 +399,11 @@ struct wd_state {
   unsigned int canvas_tick;
   struct wd_gl_data *gl_data;
   struct wd_render_data render;
+  struct wd_canvas_extent canvas_extent;
+  unsigned changed_heads; // heads whose form has unapplied changes
+  /* the scroll offset and zoom the head boxes were last placed with */
+  struct wd_point drawn_offset;
+  double drawn_zoom;
 };
 
 
@@ -243,55 +425,97 @@ void wd_fatal_error(int status, const char *message);
 /*
  * Add an output to the list of screen captured outputs.
  */
-void wd_add_output(struct wd_state *state, struct wl_output *wl_output, struct wl_display *display);
+void wd_add_output(struct wd_state *state, struct wl_output *wl_output);
 
 /*
- * Remove an output from the list of screen captured outputs.
+ * Remove an output from the list of screen captured outputs. Captures in
+ * flight for the output are cancelled.
  */
-void wd_remove_output(struct wd_state *state, struct wl_output *wl_output, struct wl_display *display);
+void wd_remove_output(struct wd_state *state, struct wl_output *wl_output);
 
 /*
  * Finds the output associated with a given head. Can return NULL if the head's
- * output is disabled.
+ * output is disabled. Constant time, the link is kept up to date as heads and
+ * outputs are named and destroyed.
  */
 struct wd_output *wd_find_output(struct wd_state *state, struct wd_head *head);
 
 /*
- * Finds the head associated with a given output.
+ * Finds the head associated with a given output, by name.
  */
 struct wd_head *wd_find_head(struct wd_state *state, struct wd_output *output);
+/*
+ * Finds the mode of a head with the given size and refresh rate, or NULL if
+ * the head doesn't advertise one.
+ */
+struct wd_mode *wd_head_find_mode(const struct wd_head *head,
+    int32_t width, int32_t height, int32_t refresh);
+
+/*
+ * Creates an unlinked shared memory file of the given size. Returns the file
+ * descriptor, or -1 on failure.
+ */
+int wd_create_shm_file(size_t size, const char *fmt, ...);
 /*
  * Starts listening for output management events from the compositor.
  */
 void wd_add_output_management_listener(struct wd_state *state, struct wl_display *display);
+/*
+ * Binds the globals announced on the display's registry, without waiting for
+ * them.
+ */
+struct wl_registry *wd_listen_registry(struct wd_state *state, struct wl_display *display);
 
 /*
- * Sends updated display configuration back to the compositor.
+ * Creates a configuration that keeps the head as the server last reported it.
+ */
+struct wd_head_config *wd_head_config_new(struct wd_head *head);
+
+/*
+ * Sends updated display configuration back to the compositor. Does not wait
+ * for a reply; the result is delivered through wd_ui_apply_done.
  */
 void wd_apply_state(struct wd_state *state, struct wl_list *new_outputs, struct wl_display *display);
 
 /*
- * Queues capture of the next frame of all screens.
+ * Asks the compositor to validate a display configuration without applying
+ * it. Takes ownership of the list. Only the result of the most recent test is
+ * delivered, through wd_ui_test_done, or through wd_ui_test_cancelled once the
+ * outputs have settled if the compositor cancelled it.
+ */
+void wd_test_state(struct wd_state *state, struct wl_list *new_outputs, struct wl_display *display);
+
+/*
+ * Queues capture of the next frame of all screens, except those whose preview
+ * was released.
  */
 void wd_capture_frame(struct wd_state *state);
 
 /*
- * Blocks until all captures are finished.
+ * Frees the captured frames of an output and stops capturing it until
+ * preview_released is cleared.
  */
-void wd_capture_wait(struct wd_state *state, struct wl_display *display);
+void wd_output_release_preview(struct wd_output *output);
 
 /*
- * Updates the UI stack of all heads. Does not update individual head forms.
+ * Updates the UI stack of all heads. Pages are keyed by head, so only new
+ * heads get a page built, and existing forms are only updated for the fields
+ * marked dirty by the compositor since the last done event.
  * Useful for when a display is plugged/unplugged and we want to add/remove
  * a page, but we don't want to wipe out user's changes on the other pages.
  */
 void wd_ui_reset_heads(struct wd_state *state);
 
+/*
+ * Removes the UI page of a head that is going away.
+ */
+void wd_ui_remove_head(struct wd_head *head);
+
 /*
  * Updates the UI form for a single head. Useful for when the compositor
  * notifies us of updated configuration caused by another program.
  */
-void wd_ui_reset_head(const struct wd_head *head, enum wd_head_fields fields);
+void wd_ui_reset_head(struct wd_head *head, enum wd_head_fields fields);
 
 /*
  * Updates the stack and all forms to the last known server state.
@@ -303,6 +527,17 @@ void wd_ui_reset_all(struct wd_state *state);
  */
 void wd_ui_apply_done(struct wd_state *state, struct wl_list *outputs);
 
+/*
+ * Shows whether the compositor would accept the pending changes.
+ */
+void wd_ui_test_done(struct wd_state *state, bool succeeded);
+
+/*
+ * Tests the pending changes again after the compositor cancelled the latest
+ * test because the outputs changed under it.
+ */
+void wd_ui_test_cancelled(struct wd_state *state);
+
 /*
  * Reactivates the GUI after the display configuration updates.
  */
@@ -323,6 +558,18 @@ void wd_gl_render(struct wd_gl_data *res, struct wd_render_data *info, uint64_t
  */
 void wd_gl_cleanup(struct wd_gl_data *res);
 
+/*
+ * Bytes of GL storage for an RGBA texture of the given size with its mipmaps.
+ */
+size_t wd_gl_texture_bytes(unsigned width, unsigned height);
+
+/*
+ * Returns the frame time in usecs below which the given fraction (0 to 1) of
+ * the recorded frames fall.
+ */
+uint32_t wd_render_stats_percentile(const struct wd_render_stats *stats,
+    double fraction);
+
 /*
  * Create an overlay on the screen that contains a textual description of the
  * output. This is to help the user identify the outputs visually.
@@ -330,7 +577,8 @@ void wd_gl_cleanup(struct wd_gl_data *res);
 void wd_create_overlay(struct wd_output *output);
 
 /*
- * Forces redrawing of the screen overlay on the given output.
+ * Redraws the screen overlay on the given output if the text it shows
+ * changed.
  */
 void wd_redraw_overlay(struct wd_output *output);
 
@@ -339,4 +587,98 @@ void wd_redraw_overlay(struct wd_output *output);
  */
 void wd_destroy_overlay(struct wd_output *output);
 
+/*
+ * Starts recording every event received on traced objects to a file.
+ */
+bool wd_trace_start(const char *path);
+
+/*
+ * Stops recording and closes the trace file.
+ */
+void wd_trace_stop(void);
+
+/*
+ * Adds a listener to a proxy, through the trace recorder when one is active.
+ */
+void wd_proxy_add_listener(struct wl_proxy *proxy, const void *listener, void *data);
+
+/*
+ * Records an output being added or removed by the UI.
+ */
+void wd_trace_output(bool added, struct wl_output *wl_output);
+
+/*
+ * Records that screen captures were requested.
+ */
+void wd_trace_capture(void);
+
+/*
+ * Feeds a recorded trace to the listeners as fast as possible, without a
+ * compositor, and prints how long it took. Returns an exit status.
+ */
+int wd_trace_replay(const char *path);
+
+/*
+ * Applies the layout in a key file without starting the UI, and returns an
+ * exit status. With dry_run, only prints what would be sent; with test_only,
+ * asks the compositor whether it would accept it.
+ */
+int wd_cli_apply(const char *path, bool dry_run, bool test_only);
+
+/*
+ * Prints the heads as JSON after the first done event, or with watch, prints
+ * what changed after every done event until the connection is lost. Returns
+ * an exit status.
+ */
+int wd_cli_dump(bool watch);
+
+/*
+ * Starts writing metrics in the Prometheus text format to a file every few
+ * seconds, for node_exporter's textfile collector.
+ */
+bool wd_metrics_start(struct wd_state *state, const char *path);
+
+/*
+ * Writes the metrics one last time and stops exporting them.
+ */
+void wd_metrics_stop(struct wd_state *state);
+
+/*
+ * Records the time from an apply to the compositor's final answer.
+ */
+void wd_metrics_apply_done(struct wd_state *state, uint64_t latency);
+
+#ifdef WDISPLAYS_PROFILING
+struct wd_span {
+  const char *name;
+  uint64_t start; // monotonic usecs, 0 when not profiling
+};
+
+/*
+ * Starts writing spans to a file in the Chrome trace event format.
+ */
+bool wd_profile_start(const char *path);
+
+/*
+ * Finishes the trace and closes the file.
+ */
+void wd_profile_stop(void);
+
+struct wd_span wd_span_begin(const char *name);
+void wd_span_end(struct wd_span *span);
+
+#define WD_SPAN_VAR_(line) wd_span_##line
+#define WD_SPAN_VAR(line) WD_SPAN_VAR_(line)
+
+/*
+ * Records a span from here to the end of the enclosing scope. Builds without
+ * the profiling option compile it to nothing.
+ */
+#define WD_SPAN(name) \
+  __attribute__((cleanup(wd_span_end))) \
+  struct wd_span WD_SPAN_VAR(__LINE__) = wd_span_begin(name)
+#else
+#define WD_SPAN(name) do { } while (0)
+#endif
+
 #endif
@@ -0,0 +1,156 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Times the layout operations the canvas runs per frame or per drag event,
+ * for 1 to 1024 heads in a grid. Each column is the cost of one operation in
+ * nanoseconds:
+ *
+ *   box      bounds of one head, after scale and rotation
+ *   canvas   mapping one head onto the canvas
+ *   extent   building the canvas extent from every head
+ *   move     moving one head, rescanning the extent when it was on an edge,
+ *            and recomputing the canvas size
+ *   snap     snapping a dragged head against all the others
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "layout.h"
+
+#define HEADS_MAX 1024
+#define WORK_PER_SIZE (1 << 22) // head-operations timed per head count
+
+static volatile double sink;
+
+static uint64_t now_nsecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void make_heads(struct wd_layout_head *heads, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    heads[i] = (struct wd_layout_head) {
+      .x = (i % 32) * 1920.,
+      .y = (i / 32) * 1080.,
+      .width = 1920.,
+      .height = 1080.,
+      .scale = 1. + (i % 3) * .25,
+      .rotation = i % 4,
+    };
+  }
+}
+
+static double bench_box(const struct wd_layout_head *heads, size_t n,
+    unsigned reps) {
+  uint64_t start = now_nsecs();
+  double acc = 0.;
+  for (unsigned r = 0; r < reps; r++) {
+    for (size_t i = 0; i < n; i++) {
+      struct wd_box box = wd_layout_box(&heads[i]);
+      acc += box.x2;
+    }
+  }
+  sink = acc;
+  return (double) (now_nsecs() - start) / ((double) reps * n);
+}
+
+static double bench_canvas(const struct wd_layout_head *heads, size_t n,
+    unsigned reps) {
+  struct wd_point offset = { .x = -20., .y = -20. };
+  uint64_t start = now_nsecs();
+  double acc = 0.;
+  for (unsigned r = 0; r < reps; r++) {
+    for (size_t i = 0; i < n; i++) {
+      struct wd_box box = wd_layout_to_canvas(&heads[i], .1, offset);
+      acc += box.y2;
+    }
+  }
+  sink = acc;
+  return (double) (now_nsecs() - start) / ((double) reps * n);
+}
+
+static void build_extent(struct wd_canvas_extent *extent,
+    const struct wd_rect *rects, size_t n) {
+  *extent = (struct wd_canvas_extent) { 0 };
+  for (size_t i = 0; i < n; i++) {
+    wd_extent_add(extent, &rects[i]);
+  }
+}
+
+static double bench_extent(const struct wd_rect *rects, size_t n,
+    unsigned reps) {
+  struct wd_canvas_extent extent;
+  uint64_t start = now_nsecs();
+  for (unsigned r = 0; r < reps; r++) {
+    build_extent(&extent, rects, n);
+    sink = extent.xmax;
+  }
+  return (double) (now_nsecs() - start) / reps;
+}
+
+/* the extent is rescanned whenever the last head was alone on an edge */
+static double bench_move(struct wd_rect *rects, size_t n, unsigned reps) {
+  struct wd_canvas_extent extent;
+  struct wd_canvas_geometry canvas;
+  build_extent(&extent, rects, n);
+  struct wd_rect *moving = &rects[n - 1];
+  uint64_t start = now_nsecs();
+  for (unsigned r = 0; r < reps; r++) {
+    int dx = r % 2 ? -16 : 16;
+    wd_extent_remove(&extent, moving);
+    moving->x1 += dx;
+    moving->x2 += dx;
+    wd_extent_add(&extent, moving);
+    if (extent.stale) {
+      build_extent(&extent, rects, n);
+    }
+    wd_layout_canvas(&extent, .1, 20, &canvas);
+    sink = canvas.width;
+  }
+  return (double) (now_nsecs() - start) / reps;
+}
+
+static double bench_snap(const struct wd_layout_head *heads, size_t n,
+    unsigned reps) {
+  static struct wd_box others[HEADS_MAX];
+  for (size_t i = 0; i < n; i++) {
+    others[i] = wd_layout_box(&heads[i]);
+  }
+  struct wd_point size = wd_layout_size(&heads[0]);
+  uint64_t start = now_nsecs();
+  double acc = 0.;
+  for (unsigned r = 0; r < reps; r++) {
+    struct wd_point tl = { .x = 1925. + r % 7, .y = 3. };
+    struct wd_point pos = wd_layout_snap(tl, size, others, n, 10.);
+    acc += pos.x;
+  }
+  sink = acc;
+  return (double) (now_nsecs() - start) / reps;
+}
+
+int main(void) {
+  static struct wd_layout_head heads[HEADS_MAX];
+  static struct wd_rect rects[HEADS_MAX];
+
+  printf("%6s %10s %10s %10s %10s %10s\n",
+      "heads", "box", "canvas", "extent", "move", "snap");
+  for (size_t n = 1; n <= HEADS_MAX; n *= 2) {
+    make_heads(heads, n);
+    for (size_t i = 0; i < n; i++) {
+      rects[i] = wd_layout_rect(&heads[i]);
+    }
+    unsigned reps = WORK_PER_SIZE / n;
+    printf("%6zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", n,
+        bench_box(heads, n, reps),
+        bench_canvas(heads, n, reps),
+        bench_extent(rects, n, reps),
+        bench_move(rects, n, reps),
+        bench_snap(heads, n, reps));
+  }
+  return EXIT_SUCCESS;
+}
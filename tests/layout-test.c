@@ -0,0 +1,199 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Checks the layout geometry: sizes under scale and rotation, canvas extents
+ * as heads come and go or overlap, the canvas mapping and snapping.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "layout.h"
+
+static int failures;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    failures++; \
+  } \
+} while (0)
+
+#define CHECK_POINT(p, px, py) CHECK((p).x == (px) && (p).y == (py))
+
+static struct wd_layout_head head_at(double x, double y,
+    double width, double height, double scale, int rotation) {
+  return (struct wd_layout_head) {
+    .x = x, .y = y,
+    .width = width, .height = height,
+    .scale = scale,
+    .rotation = rotation,
+  };
+}
+
+static struct wd_rect rect(int x1, int y1, int x2, int y2) {
+  return (struct wd_rect) { .x1 = x1, .y1 = y1, .x2 = x2, .y2 = y2 };
+}
+
+static void test_rotation(void) {
+  struct wd_layout_head head = head_at(0, 0, 1920, 1080, 1., 0);
+  CHECK_POINT(wd_layout_size(&head), 1920, 1080);
+  head.rotation = 1;
+  CHECK_POINT(wd_layout_size(&head), 1080, 1920);
+  head.rotation = 2;
+  CHECK_POINT(wd_layout_size(&head), 1920, 1080);
+  head.rotation = 3;
+  CHECK_POINT(wd_layout_size(&head), 1080, 1920);
+
+  head.scale = 2.;
+  CHECK_POINT(wd_layout_size(&head), 540, 960);
+  head.scale = 1.5;
+  head.rotation = 0;
+  CHECK_POINT(wd_layout_size(&head), 1280, 720);
+
+  /* an unset scale leaves the mode size alone */
+  head.scale = 0.;
+  CHECK_POINT(wd_layout_size(&head), 1920, 1080);
+}
+
+static void test_box(void) {
+  struct wd_layout_head head = head_at(100, -50, 1280, 1024, 1.25, 1);
+  struct wd_box box = wd_layout_box(&head);
+  CHECK(box.x1 == 100 && box.y1 == -50);
+  CHECK(box.x2 == 100 + 819.2 && box.y2 == -50 + 1024);
+
+  struct wd_rect r = wd_layout_rect(&head);
+  struct wd_rect expected = rect(100, -50, 919, 974);
+  CHECK(wd_rect_equal(&r, &expected));
+}
+
+static void test_extent(void) {
+  struct wd_canvas_extent extent = { 0 };
+  struct wd_rect left = rect(-1920, 0, 0, 1080);
+  struct wd_rect middle = rect(0, 0, 1920, 1080);
+  struct wd_rect right = rect(1920, 200, 3200, 920);
+
+  wd_extent_add(&extent, &middle);
+  wd_extent_add(&extent, &left);
+  wd_extent_add(&extent, &right);
+  CHECK(extent.heads == 3);
+  CHECK(extent.xmin == -1920 && extent.xmax == 3200);
+  CHECK(extent.ymin == 0 && extent.ymax == 1080);
+  CHECK(extent.xmin_count == 1 && extent.xmax_count == 1);
+  CHECK(extent.ymin_count == 2 && extent.ymax_count == 2);
+
+  /* still one head on each edge it touched */
+  wd_extent_remove(&extent, &middle);
+  CHECK(!extent.stale);
+  CHECK(extent.ymin_count == 1 && extent.ymax_count == 1);
+
+  wd_extent_remove(&extent, &right);
+  CHECK(extent.stale);
+  CHECK(extent.heads == 1);
+}
+
+static void test_overlap(void) {
+  /* mirrored heads share every edge */
+  struct wd_canvas_extent extent = { 0 };
+  struct wd_rect a = rect(0, 0, 1920, 1080);
+  struct wd_rect b = rect(0, 0, 1920, 1080);
+  struct wd_rect inner = rect(100, 100, 200, 200);
+  wd_extent_add(&extent, &a);
+  wd_extent_add(&extent, &b);
+  wd_extent_add(&extent, &inner);
+  CHECK(extent.xmin_count == 2 && extent.ymax_count == 2);
+  wd_extent_remove(&extent, &a);
+  CHECK(!extent.stale);
+  wd_extent_remove(&extent, &inner);
+  CHECK(!extent.stale);
+  wd_extent_remove(&extent, &b);
+  CHECK(extent.stale);
+  CHECK(extent.heads == 0);
+
+  /* hit testing is half-open, so overlapping boxes only share interiors */
+  struct wd_box left = { 0, 0, 100, 100 };
+  struct wd_box right = { 50, 0, 150, 100 };
+  CHECK(wd_box_contains(&left, 75, 50) && wd_box_contains(&right, 75, 50));
+  CHECK(!wd_box_contains(&left, 100, 50) && wd_box_contains(&right, 100, 50));
+  CHECK(wd_box_contains(&left, 0, 0) && !wd_box_contains(&left, 0, 100));
+}
+
+static void test_canvas(void) {
+  struct wd_canvas_extent extent = { 0 };
+  struct wd_canvas_geometry canvas;
+  wd_layout_canvas(&extent, .5, 10, &canvas);
+  CHECK(canvas.x_origin == -10 && canvas.y_origin == -10);
+  CHECK(canvas.width == 20 && canvas.height == 20);
+
+  /* always includes the origin */
+  struct wd_rect r = rect(100, 100, 200, 300);
+  wd_extent_add(&extent, &r);
+  wd_layout_canvas(&extent, .5, 10, &canvas);
+  CHECK(canvas.x_origin == -10 && canvas.y_origin == -10);
+  CHECK(canvas.width == 120 && canvas.height == 170);
+
+  struct wd_rect negative = rect(-300, -101, 0, 0);
+  wd_extent_add(&extent, &negative);
+  wd_layout_canvas(&extent, .5, 10, &canvas);
+  CHECK(canvas.x_origin == -160 && canvas.y_origin == -61);
+  CHECK(canvas.width == 270 && canvas.height == 221);
+}
+
+static void test_canvas_mapping(void) {
+  struct wd_layout_head head = head_at(100, 40, 1920, 1080, 2., 1);
+  struct wd_point offset = { .x = -10, .y = 5 };
+  struct wd_box box = wd_layout_to_canvas(&head, .25, offset);
+  CHECK(box.x1 == 35 && box.y1 == 5);
+  CHECK(box.x2 == 35 + 135 && box.y2 == 5 + 240);
+
+  struct wd_point tl = { .x = box.x1, .y = box.y1 };
+  CHECK_POINT(wd_canvas_to_layout(tl, .25, offset), 100, 40);
+}
+
+static void test_snap(void) {
+  const struct wd_box others[] = {
+    { 0, 0, 1920, 1080 },
+    { 1920, 0, 3200, 1024 },
+  };
+  struct wd_point size = { .x = 1280, .y = 720 };
+  const double dist = 10.;
+
+  /* nothing to snap to */
+  struct wd_point tl = { .x = 3, .y = -4 };
+  CHECK_POINT(wd_layout_snap(tl, size, NULL, 0, dist), 3, -4);
+
+  /* the top left corner to a right edge and the top of the layout */
+  tl = (struct wd_point) { .x = 3205, .y = 3 };
+  CHECK_POINT(wd_layout_snap(tl, size, others, 2, dist), 3200, 0);
+
+  /* the bottom right corner to a left edge and a bottom edge */
+  tl = (struct wd_point) { .x = -1275, .y = 1024 - 715 };
+  CHECK_POINT(wd_layout_snap(tl, size, others, 2, dist), -1280, 1024 - 720);
+
+  /* an edge just out of reach doesn't pull */
+  tl = (struct wd_point) { .x = 500, .y = 1091 };
+  CHECK_POINT(wd_layout_snap(tl, size, others, 2, dist), 500, 1091);
+  tl.y = 1090;
+  CHECK_POINT(wd_layout_snap(tl, size, others, 2, dist), 500, 1080);
+
+  /* the top left corner wins over the bottom right one */
+  struct wd_point small = { .x = 1915, .y = 100 };
+  tl = (struct wd_point) { .x = 2, .y = 500 };
+  CHECK_POINT(wd_layout_snap(tl, small, others, 1, dist), 0, 500);
+}
+
+int main(void) {
+  test_rotation();
+  test_box();
+  test_extent();
+  test_overlap();
+  test_canvas();
+  test_canvas_mapping();
+  test_snap();
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
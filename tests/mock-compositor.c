@@ -0,0 +1,1384 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * A headless Wayland server for running wdisplays without a real compositor.
+ * It offers wlr-output-management, xdg-output and wlr-screencopy over virtual
+ * heads that a script can plug, unplug and move. Applies and captures can be
+ * delayed, failed or cancelled on request, and the frames it hands out are
+ * synthetic patterns that change every capture.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <wayland-server.h>
+
+#include "wlr-output-management-unstable-v1-server-protocol.h"
+#include "wlr-screencopy-unstable-v1-server-protocol.h"
+#include "xdg-output-unstable-v1-server-protocol.h"
+
+#define DEFAULT_HEADS 2
+#define MAX_ARGS 16
+
+struct mock_server;
+
+struct mock_mode {
+  struct wl_list link;
+  struct mock_head *head;
+  int32_t width;
+  int32_t height;
+  int32_t refresh;
+  bool preferred;
+};
+
+struct mock_head {
+  struct mock_server *server;
+  struct wl_list link;
+  char *name;
+  uint32_t color;
+
+  struct wl_list modes;
+  struct mock_mode *mode;
+  bool enabled;
+  int32_t x;
+  int32_t y;
+  int32_t transform;
+  wl_fixed_t scale;
+
+  struct wl_list head_resources;
+  struct wl_list output_resources;
+  struct wl_list xdg_resources;
+  struct wl_list frames;
+  struct wl_global *output_global;
+};
+
+/* one zwlr_output_head_v1 and the mode objects sent along with it */
+struct mock_head_resource {
+  struct wl_list link;
+  struct wl_resource *resource;
+  struct mock_head *head;
+  struct wl_list modes;
+};
+
+struct mock_config_head {
+  struct wl_list link;
+  struct wl_resource *resource;
+  struct mock_head *head;
+  bool enabled;
+  struct mock_mode *mode;
+  bool custom_mode;
+  int32_t width;
+  int32_t height;
+  int32_t refresh;
+  bool has_position;
+  int32_t x;
+  int32_t y;
+  bool has_transform;
+  int32_t transform;
+  bool has_scale;
+  wl_fixed_t scale;
+};
+
+struct mock_config {
+  struct mock_server *server;
+  struct wl_resource *resource;
+  uint32_t serial;
+  struct wl_list heads;
+  bool used;
+  bool test_only;
+  struct wl_event_source *timer;
+};
+
+struct mock_frame {
+  struct mock_server *server;
+  struct wl_list link;
+  struct wl_resource *resource;
+  struct mock_head *head;
+  int32_t width;
+  int32_t height;
+  bool used;
+  struct wl_resource *buffer;
+  struct wl_listener buffer_destroy;
+  struct wl_event_source *timer;
+};
+
+struct mock_stats {
+  unsigned applies;
+  unsigned tests;
+  unsigned succeeded;
+  unsigned failed;
+  unsigned cancelled;
+  unsigned captures;
+  unsigned capture_failures;
+  uint64_t capture_bytes;
+  unsigned hotplugs;
+};
+
+struct mock_server {
+  struct wl_display *display;
+  struct wl_event_loop *loop;
+  uint32_t serial;
+  unsigned next_head;
+
+  struct wl_list heads;
+  struct wl_list manager_resources;
+
+  int apply_latency;
+  int capture_latency;
+  unsigned fail_applies;
+  unsigned cancel_applies;
+  unsigned fail_captures;
+
+  char **script;
+  size_t script_len;
+  size_t script_pos;
+  struct wl_event_source *script_timer;
+
+  struct mock_stats stats;
+};
+
+static void unlink_resource(struct wl_resource *resource) {
+  wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void destroy_resource(struct wl_client *client,
+    struct wl_resource *resource) {
+  wl_resource_destroy(resource);
+}
+
+static void mode_logical_size(struct mock_head *head,
+    int32_t *width, int32_t *height) {
+  int32_t w = head->mode != NULL ? head->mode->width : 0;
+  int32_t h = head->mode != NULL ? head->mode->height : 0;
+  if (head->transform % 2 == 1) {
+    int32_t tmp = w;
+    w = h;
+    h = tmp;
+  }
+  double scale = wl_fixed_to_double(head->scale);
+  *width = (int32_t) (w / scale);
+  *height = (int32_t) (h / scale);
+}
+
+/* wl_output and xdg-output */
+
+static void send_output_state(struct wl_resource *resource,
+    struct mock_head *head) {
+  wl_output_send_geometry(resource, head->x, head->y, 0, 0,
+      WL_OUTPUT_SUBPIXEL_UNKNOWN, "wdisplays", "mock", head->transform);
+  if (head->mode != NULL) {
+    uint32_t flags = WL_OUTPUT_MODE_CURRENT;
+    if (head->mode->preferred)
+      flags |= WL_OUTPUT_MODE_PREFERRED;
+    wl_output_send_mode(resource, flags,
+        head->mode->width, head->mode->height, head->mode->refresh);
+  }
+  if (wl_resource_get_version(resource) >= WL_OUTPUT_SCALE_SINCE_VERSION)
+    wl_output_send_scale(resource, wl_fixed_to_int(head->scale));
+  if (wl_resource_get_version(resource) >= WL_OUTPUT_DONE_SINCE_VERSION)
+    wl_output_send_done(resource);
+}
+
+static void send_xdg_output_state(struct wl_resource *resource,
+    struct mock_head *head) {
+  int32_t width, height;
+  mode_logical_size(head, &width, &height);
+  zxdg_output_v1_send_logical_position(resource, head->x, head->y);
+  zxdg_output_v1_send_logical_size(resource, width, height);
+  if (wl_resource_get_version(resource) >= ZXDG_OUTPUT_V1_NAME_SINCE_VERSION) {
+    zxdg_output_v1_send_name(resource, head->name);
+    zxdg_output_v1_send_description(resource, head->name);
+  }
+  zxdg_output_v1_send_done(resource);
+}
+
+static const struct wl_output_interface output_impl = {
+  .release = destroy_resource,
+};
+
+static void output_bind(struct wl_client *client, void *data,
+    uint32_t version, uint32_t id) {
+  struct mock_head *head = data;
+  struct wl_resource *resource =
+    wl_resource_create(client, &wl_output_interface, version, id);
+  if (resource == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  wl_resource_set_implementation(resource, &output_impl, head,
+      unlink_resource);
+  wl_list_insert(&head->output_resources, wl_resource_get_link(resource));
+  send_output_state(resource, head);
+}
+
+static const struct zxdg_output_v1_interface xdg_output_impl = {
+  .destroy = destroy_resource,
+};
+
+static void xdg_output_manager_get_xdg_output(struct wl_client *client,
+    struct wl_resource *manager, uint32_t id, struct wl_resource *output) {
+  struct mock_head *head = wl_resource_get_user_data(output);
+  struct wl_resource *resource = wl_resource_create(client,
+      &zxdg_output_v1_interface, wl_resource_get_version(manager), id);
+  if (resource == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  wl_resource_set_implementation(resource, &xdg_output_impl, head,
+      unlink_resource);
+  if (head == NULL) {
+    wl_list_init(wl_resource_get_link(resource));
+    return;
+  }
+  wl_list_insert(&head->xdg_resources, wl_resource_get_link(resource));
+  send_xdg_output_state(resource, head);
+}
+
+static const struct zxdg_output_manager_v1_interface xdg_output_manager_impl = {
+  .destroy = destroy_resource,
+  .get_xdg_output = xdg_output_manager_get_xdg_output,
+};
+
+static void xdg_output_manager_bind(struct wl_client *client, void *data,
+    uint32_t version, uint32_t id) {
+  struct wl_resource *resource = wl_resource_create(client,
+      &zxdg_output_manager_v1_interface, version, id);
+  if (resource == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  wl_resource_set_implementation(resource, &xdg_output_manager_impl, data,
+      NULL);
+}
+
+/* inert resources keep their requests but no longer point at the head */
+static void detach_resources(struct wl_list *resources) {
+  struct wl_resource *resource, *tmp;
+  wl_resource_for_each_safe(resource, tmp, resources) {
+    wl_resource_set_user_data(resource, NULL);
+    unlink_resource(resource);
+    wl_list_init(wl_resource_get_link(resource));
+  }
+}
+
+static void sync_output_global(struct mock_head *head) {
+  if (head->enabled && head->output_global == NULL) {
+    head->output_global = wl_global_create(head->server->display,
+        &wl_output_interface, 3, head, output_bind);
+  } else if (!head->enabled && head->output_global != NULL) {
+    detach_resources(&head->output_resources);
+    detach_resources(&head->xdg_resources);
+    wl_global_destroy(head->output_global);
+    head->output_global = NULL;
+  }
+}
+
+/* output management */
+
+static void mode_resource_destroy(struct wl_resource *resource) {
+  wl_list_remove(wl_resource_get_link(resource));
+}
+
+static struct wl_resource *announce_mode(struct mock_head_resource *hr,
+    struct mock_mode *mode) {
+  struct wl_client *client = wl_resource_get_client(hr->resource);
+  struct wl_resource *resource = wl_resource_create(client,
+      &zwlr_output_mode_v1_interface, wl_resource_get_version(hr->resource), 0);
+  if (resource == NULL) {
+    wl_client_post_no_memory(client);
+    return NULL;
+  }
+  wl_resource_set_implementation(resource, NULL, mode, mode_resource_destroy);
+  wl_list_insert(hr->modes.prev, wl_resource_get_link(resource));
+  zwlr_output_head_v1_send_mode(hr->resource, resource);
+  zwlr_output_mode_v1_send_size(resource, mode->width, mode->height);
+  zwlr_output_mode_v1_send_refresh(resource, mode->refresh);
+  if (mode->preferred)
+    zwlr_output_mode_v1_send_preferred(resource);
+  return resource;
+}
+
+static void send_head_state(struct mock_head_resource *hr) {
+  struct mock_head *head = hr->head;
+  zwlr_output_head_v1_send_enabled(hr->resource, head->enabled);
+  if (head->enabled && head->mode != NULL) {
+    struct wl_resource *mode;
+    wl_resource_for_each(mode, &hr->modes) {
+      if (wl_resource_get_user_data(mode) == head->mode) {
+        zwlr_output_head_v1_send_current_mode(hr->resource, mode);
+        break;
+      }
+    }
+  }
+  if (head->enabled) {
+    zwlr_output_head_v1_send_position(hr->resource, head->x, head->y);
+    zwlr_output_head_v1_send_transform(hr->resource, head->transform);
+    zwlr_output_head_v1_send_scale(hr->resource, head->scale);
+  }
+}
+
+static void head_resource_destroy(struct wl_resource *resource) {
+  struct mock_head_resource *hr = wl_resource_get_user_data(resource);
+  struct wl_resource *mode, *tmp;
+  wl_resource_for_each_safe(mode, tmp, &hr->modes) {
+    unlink_resource(mode);
+    wl_list_init(wl_resource_get_link(mode));
+  }
+  wl_list_remove(&hr->link);
+  free(hr);
+}
+
+static void announce_head(struct mock_head *head, struct wl_resource *manager) {
+  struct wl_client *client = wl_resource_get_client(manager);
+  struct mock_head_resource *hr = calloc(1, sizeof(*hr));
+  if (hr == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  hr->resource = wl_resource_create(client, &zwlr_output_head_v1_interface,
+      wl_resource_get_version(manager), 0);
+  if (hr->resource == NULL) {
+    free(hr);
+    wl_client_post_no_memory(client);
+    return;
+  }
+  hr->head = head;
+  wl_list_init(&hr->modes);
+  wl_list_insert(head->head_resources.prev, &hr->link);
+  wl_resource_set_implementation(hr->resource, NULL, hr,
+      head_resource_destroy);
+
+  zwlr_output_manager_v1_send_head(manager, hr->resource);
+  zwlr_output_head_v1_send_name(hr->resource, head->name);
+  zwlr_output_head_v1_send_description(hr->resource, head->name);
+  struct mock_mode *mode;
+  wl_list_for_each(mode, &head->modes, link) {
+    announce_mode(hr, mode);
+  }
+  send_head_state(hr);
+}
+
+static void send_done(struct mock_server *server) {
+  struct wl_resource *manager;
+  server->serial = wl_display_next_serial(server->display);
+  wl_resource_for_each(manager, &server->manager_resources) {
+    zwlr_output_manager_v1_send_done(manager, server->serial);
+  }
+}
+
+static void update_head(struct mock_head *head) {
+  struct mock_head_resource *hr;
+  struct wl_resource *resource;
+  sync_output_global(head);
+  wl_list_for_each(hr, &head->head_resources, link) {
+    send_head_state(hr);
+  }
+  wl_resource_for_each(resource, &head->output_resources) {
+    send_output_state(resource, head);
+  }
+  wl_resource_for_each(resource, &head->xdg_resources) {
+    send_xdg_output_state(resource, head);
+  }
+}
+
+static struct mock_mode *add_mode(struct mock_head *head,
+    int32_t width, int32_t height, int32_t refresh) {
+  struct mock_mode *mode;
+  wl_list_for_each(mode, &head->modes, link) {
+    if (mode->width == width && mode->height == height
+        && mode->refresh == refresh)
+      return mode;
+  }
+  mode = calloc(1, sizeof(*mode));
+  if (mode == NULL)
+    return NULL;
+  mode->head = head;
+  mode->width = width;
+  mode->height = height;
+  mode->refresh = refresh;
+  wl_list_insert(head->modes.prev, &mode->link);
+
+  struct mock_head_resource *hr;
+  wl_list_for_each(hr, &head->head_resources, link) {
+    announce_mode(hr, mode);
+  }
+  return mode;
+}
+
+static void config_head_destroy(struct wl_resource *resource) {
+  struct mock_config_head *ch = wl_resource_get_user_data(resource);
+  if (ch != NULL)
+    ch->resource = NULL;
+}
+
+static struct mock_config_head *config_head_from_resource(
+    struct wl_resource *resource) {
+  return wl_resource_get_user_data(resource);
+}
+
+static void config_head_set_mode(struct wl_client *client,
+    struct wl_resource *resource, struct wl_resource *mode_resource) {
+  struct mock_config_head *ch = config_head_from_resource(resource);
+  struct mock_mode *mode = wl_resource_get_user_data(mode_resource);
+  /* a finished mode means the head is gone and the apply will be cancelled */
+  if (ch == NULL || ch->head == NULL || mode == NULL)
+    return;
+  if (ch->mode != NULL || ch->custom_mode) {
+    wl_resource_post_error(resource,
+        ZWLR_OUTPUT_CONFIGURATION_HEAD_V1_ERROR_ALREADY_SET,
+        "mode has already been set");
+    return;
+  }
+  if (mode->head != ch->head) {
+    wl_resource_post_error(resource,
+        ZWLR_OUTPUT_CONFIGURATION_HEAD_V1_ERROR_INVALID_MODE,
+        "mode doesn't belong to head");
+    return;
+  }
+  ch->mode = mode;
+}
+
+static void config_head_set_custom_mode(struct wl_client *client,
+    struct wl_resource *resource, int32_t width, int32_t height,
+    int32_t refresh) {
+  struct mock_config_head *ch = config_head_from_resource(resource);
+  if (ch == NULL)
+    return;
+  if (ch->mode != NULL || ch->custom_mode) {
+    wl_resource_post_error(resource,
+        ZWLR_OUTPUT_CONFIGURATION_HEAD_V1_ERROR_ALREADY_SET,
+        "mode has already been set");
+    return;
+  }
+  if (width <= 0 || height <= 0 || refresh < 0) {
+    wl_resource_post_error(resource,
+        ZWLR_OUTPUT_CONFIGURATION_HEAD_V1_ERROR_INVALID_CUSTOM_MODE,
+        "invalid custom mode %dx%d@%d", width, height, refresh);
+    return;
+  }
+  ch->custom_mode = true;
+  ch->width = width;
+  ch->height = height;
+  ch->refresh = refresh;
+}
+
+static void config_head_set_position(struct wl_client *client,
+    struct wl_resource *resource, int32_t x, int32_t y) {
+  struct mock_config_head *ch = config_head_from_resource(resource);
+  if (ch == NULL)
+    return;
+  if (ch->has_position) {
+    wl_resource_post_error(resource,
+        ZWLR_OUTPUT_CONFIGURATION_HEAD_V1_ERROR_ALREADY_SET,
+        "position has already been set");
+    return;
+  }
+  ch->has_position = true;
+  ch->x = x;
+  ch->y = y;
+}
+
+static void config_head_set_transform(struct wl_client *client,
+    struct wl_resource *resource, int32_t transform) {
+  struct mock_config_head *ch = config_head_from_resource(resource);
+  if (ch == NULL)
+    return;
+  if (ch->has_transform) {
+    wl_resource_post_error(resource,
+        ZWLR_OUTPUT_CONFIGURATION_HEAD_V1_ERROR_ALREADY_SET,
+        "transform has already been set");
+    return;
+  }
+  if (transform < WL_OUTPUT_TRANSFORM_NORMAL
+      || transform > WL_OUTPUT_TRANSFORM_FLIPPED_270) {
+    wl_resource_post_error(resource,
+        ZWLR_OUTPUT_CONFIGURATION_HEAD_V1_ERROR_INVALID_TRANSFORM,
+        "invalid transform %d", transform);
+    return;
+  }
+  ch->has_transform = true;
+  ch->transform = transform;
+}
+
+static void config_head_set_scale(struct wl_client *client,
+    struct wl_resource *resource, wl_fixed_t scale) {
+  struct mock_config_head *ch = config_head_from_resource(resource);
+  if (ch == NULL)
+    return;
+  if (ch->has_scale) {
+    wl_resource_post_error(resource,
+        ZWLR_OUTPUT_CONFIGURATION_HEAD_V1_ERROR_ALREADY_SET,
+        "scale has already been set");
+    return;
+  }
+  if (scale <= 0) {
+    wl_resource_post_error(resource,
+        ZWLR_OUTPUT_CONFIGURATION_HEAD_V1_ERROR_INVALID_SCALE,
+        "invalid scale %f", wl_fixed_to_double(scale));
+    return;
+  }
+  ch->has_scale = true;
+  ch->scale = scale;
+}
+
+static const struct zwlr_output_configuration_head_v1_interface
+config_head_impl = {
+  .set_mode = config_head_set_mode,
+  .set_custom_mode = config_head_set_custom_mode,
+  .set_position = config_head_set_position,
+  .set_transform = config_head_set_transform,
+  .set_scale = config_head_set_scale,
+};
+
+static struct mock_config_head *config_add_head(struct mock_config *config,
+    struct wl_resource *head_resource) {
+  struct mock_head_resource *hr = wl_resource_get_user_data(head_resource);
+  struct mock_head *head = hr != NULL ? hr->head : NULL;
+  struct mock_config_head *ch;
+  if (head != NULL) {
+    wl_list_for_each(ch, &config->heads, link) {
+      if (ch->head == head) {
+        wl_resource_post_error(config->resource,
+            ZWLR_OUTPUT_CONFIGURATION_V1_ERROR_ALREADY_CONFIGURED_HEAD,
+            "head %s has already been configured", head->name);
+        return NULL;
+      }
+    }
+  }
+  ch = calloc(1, sizeof(*ch));
+  if (ch == NULL) {
+    wl_client_post_no_memory(wl_resource_get_client(config->resource));
+    return NULL;
+  }
+  ch->head = head;
+  wl_list_insert(config->heads.prev, &ch->link);
+  return ch;
+}
+
+static void config_enable_head(struct wl_client *client,
+    struct wl_resource *resource, uint32_t id,
+    struct wl_resource *head_resource) {
+  struct mock_config *config = wl_resource_get_user_data(resource);
+  struct wl_resource *ch_resource = wl_resource_create(client,
+      &zwlr_output_configuration_head_v1_interface,
+      wl_resource_get_version(resource), id);
+  if (ch_resource == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  struct mock_config_head *ch = config_add_head(config, head_resource);
+  wl_resource_set_implementation(ch_resource, &config_head_impl, ch,
+      config_head_destroy);
+  if (ch != NULL) {
+    ch->resource = ch_resource;
+    ch->enabled = true;
+  }
+}
+
+static void config_disable_head(struct wl_client *client,
+    struct wl_resource *resource, struct wl_resource *head_resource) {
+  struct mock_config *config = wl_resource_get_user_data(resource);
+  config_add_head(config, head_resource);
+}
+
+static bool config_covers(struct mock_config *config, struct mock_head *head) {
+  struct mock_config_head *ch;
+  wl_list_for_each(ch, &config->heads, link) {
+    if (ch->head == head)
+      return true;
+  }
+  return false;
+}
+
+static void apply_config(struct mock_config *config) {
+  struct mock_config_head *ch;
+  wl_list_for_each(ch, &config->heads, link) {
+    struct mock_head *head = ch->head;
+    if (head == NULL)
+      continue;
+    head->enabled = ch->enabled;
+    if (!ch->enabled)
+      continue;
+    if (ch->mode != NULL)
+      head->mode = ch->mode;
+    else if (ch->custom_mode)
+      head->mode = add_mode(head, ch->width, ch->height, ch->refresh);
+    if (head->mode == NULL && !wl_list_empty(&head->modes))
+      head->mode = wl_container_of(head->modes.next, head->mode, link);
+    if (ch->has_position) {
+      head->x = ch->x;
+      head->y = ch->y;
+    }
+    if (ch->has_transform)
+      head->transform = ch->transform;
+    if (ch->has_scale)
+      head->scale = ch->scale;
+  }
+  wl_list_for_each(ch, &config->heads, link) {
+    if (ch->head != NULL)
+      update_head(ch->head);
+  }
+}
+
+static void config_finish(struct mock_config *config) {
+  struct mock_server *server = config->server;
+  if (config->timer != NULL) {
+    wl_event_source_remove(config->timer);
+    config->timer = NULL;
+  }
+
+  if (config->serial != server->serial) {
+    server->stats.cancelled++;
+    zwlr_output_configuration_v1_send_cancelled(config->resource);
+  } else if (server->cancel_applies > 0) {
+    /* pretend another client got there first */
+    server->cancel_applies--;
+    server->stats.cancelled++;
+    send_done(server);
+    zwlr_output_configuration_v1_send_cancelled(config->resource);
+  } else if (server->fail_applies > 0) {
+    server->fail_applies--;
+    server->stats.failed++;
+    zwlr_output_configuration_v1_send_failed(config->resource);
+  } else {
+    server->stats.succeeded++;
+    zwlr_output_configuration_v1_send_succeeded(config->resource);
+    if (!config->test_only) {
+      apply_config(config);
+      send_done(server);
+    }
+  }
+}
+
+static int config_timer(void *data) {
+  config_finish(data);
+  return 0;
+}
+
+static void config_submit(struct wl_resource *resource, bool test_only) {
+  struct mock_config *config = wl_resource_get_user_data(resource);
+  struct mock_server *server = config->server;
+  if (config->used) {
+    wl_resource_post_error(resource,
+        ZWLR_OUTPUT_CONFIGURATION_V1_ERROR_ALREADY_USED,
+        "configuration has already been used");
+    return;
+  }
+  config->used = true;
+  config->test_only = test_only;
+  if (test_only)
+    server->stats.tests++;
+  else
+    server->stats.applies++;
+
+  if (config->serial == server->serial) {
+    struct mock_head *head;
+    wl_list_for_each(head, &server->heads, link) {
+      if (!config_covers(config, head)) {
+        wl_resource_post_error(resource,
+            ZWLR_OUTPUT_CONFIGURATION_V1_ERROR_UNCONFIGURED_HEAD,
+            "head %s is not configured", head->name);
+        return;
+      }
+    }
+  }
+
+  if (server->apply_latency > 0) {
+    config->timer = wl_event_loop_add_timer(server->loop, config_timer,
+        config);
+    wl_event_source_timer_update(config->timer, server->apply_latency);
+  } else {
+    config_finish(config);
+  }
+}
+
+static void config_apply(struct wl_client *client,
+    struct wl_resource *resource) {
+  config_submit(resource, false);
+}
+
+static void config_test(struct wl_client *client,
+    struct wl_resource *resource) {
+  config_submit(resource, true);
+}
+
+static const struct zwlr_output_configuration_v1_interface config_impl = {
+  .enable_head = config_enable_head,
+  .disable_head = config_disable_head,
+  .apply = config_apply,
+  .test = config_test,
+  .destroy = destroy_resource,
+};
+
+static void config_destroy(struct wl_resource *resource) {
+  struct mock_config *config = wl_resource_get_user_data(resource);
+  struct mock_config_head *ch, *tmp;
+  if (config->timer != NULL)
+    wl_event_source_remove(config->timer);
+  wl_list_for_each_safe(ch, tmp, &config->heads, link) {
+    if (ch->resource != NULL)
+      wl_resource_set_user_data(ch->resource, NULL);
+    wl_list_remove(&ch->link);
+    free(ch);
+  }
+  free(config);
+}
+
+static void manager_create_configuration(struct wl_client *client,
+    struct wl_resource *resource, uint32_t id, uint32_t serial) {
+  struct mock_server *server = wl_resource_get_user_data(resource);
+  struct mock_config *config = calloc(1, sizeof(*config));
+  if (config == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  config->resource = wl_resource_create(client,
+      &zwlr_output_configuration_v1_interface,
+      wl_resource_get_version(resource), id);
+  if (config->resource == NULL) {
+    free(config);
+    wl_client_post_no_memory(client);
+    return;
+  }
+  config->server = server;
+  config->serial = serial;
+  wl_list_init(&config->heads);
+  wl_resource_set_implementation(config->resource, &config_impl, config,
+      config_destroy);
+}
+
+static void manager_stop(struct wl_client *client,
+    struct wl_resource *resource) {
+  zwlr_output_manager_v1_send_finished(resource);
+  wl_resource_destroy(resource);
+}
+
+static const struct zwlr_output_manager_v1_interface manager_impl = {
+  .create_configuration = manager_create_configuration,
+  .stop = manager_stop,
+};
+
+static void manager_bind(struct wl_client *client, void *data,
+    uint32_t version, uint32_t id) {
+  struct mock_server *server = data;
+  struct wl_resource *resource = wl_resource_create(client,
+      &zwlr_output_manager_v1_interface, version, id);
+  if (resource == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  wl_resource_set_implementation(resource, &manager_impl, server,
+      unlink_resource);
+  wl_list_insert(&server->manager_resources, wl_resource_get_link(resource));
+
+  struct mock_head *head;
+  wl_list_for_each(head, &server->heads, link) {
+    announce_head(head, resource);
+  }
+  zwlr_output_manager_v1_send_done(resource, server->serial);
+}
+
+/* screencopy */
+
+/* a frame only reports once, so it stops following its head after that */
+static void frame_detach(struct mock_frame *frame) {
+  frame->head = NULL;
+  wl_list_remove(&frame->link);
+  wl_list_init(&frame->link);
+}
+
+static void frame_fail(struct mock_frame *frame) {
+  frame_detach(frame);
+  frame->server->stats.capture_failures++;
+  zwlr_screencopy_frame_v1_send_failed(frame->resource);
+}
+
+static void frame_unlink_buffer(struct mock_frame *frame) {
+  if (frame->buffer != NULL) {
+    wl_list_remove(&frame->buffer_destroy.link);
+    frame->buffer = NULL;
+  }
+}
+
+static void frame_handle_buffer_destroy(struct wl_listener *listener,
+    void *data) {
+  struct mock_frame *frame =
+    wl_container_of(listener, frame, buffer_destroy);
+  frame_unlink_buffer(frame);
+}
+
+static void fill_frame(struct mock_frame *frame, struct wl_shm_buffer *shm) {
+  struct mock_server *server = frame->server;
+  uint8_t *data = wl_shm_buffer_get_data(shm);
+  int32_t stride = wl_shm_buffer_get_stride(shm);
+  uint32_t phase = server->stats.captures * 8;
+
+  wl_shm_buffer_begin_access(shm);
+  for (int32_t y = 0; y < frame->height; y++) {
+    uint32_t *row = (uint32_t *) (data + (size_t) y * stride);
+    for (int32_t x = 0; x < frame->width; x++) {
+      uint32_t band = ((x + phase) / 64 + y / 64) % 2 ? 0x404040 : 0;
+      row[x] = 0xff000000 | (frame->head->color ^ band);
+    }
+  }
+  wl_shm_buffer_end_access(shm);
+}
+
+static void frame_finish(struct mock_frame *frame) {
+  struct mock_server *server = frame->server;
+  if (frame->timer != NULL) {
+    wl_event_source_remove(frame->timer);
+    frame->timer = NULL;
+  }
+  struct wl_shm_buffer *shm = frame->buffer != NULL
+    ? wl_shm_buffer_get(frame->buffer) : NULL;
+  if (frame->head == NULL || shm == NULL) {
+    frame_fail(frame);
+    return;
+  }
+
+  fill_frame(frame, shm);
+  frame_unlink_buffer(frame);
+  frame_detach(frame);
+  server->stats.captures++;
+  server->stats.capture_bytes += (uint64_t) frame->width * frame->height * 4;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t sec = now.tv_sec;
+  zwlr_screencopy_frame_v1_send_flags(frame->resource, 0);
+  zwlr_screencopy_frame_v1_send_ready(frame->resource,
+      sec >> 32, sec & 0xffffffff, now.tv_nsec);
+}
+
+static int frame_timer(void *data) {
+  frame_finish(data);
+  return 0;
+}
+
+static void frame_copy(struct wl_client *client, struct wl_resource *resource,
+    struct wl_resource *buffer) {
+  struct mock_frame *frame = wl_resource_get_user_data(resource);
+  struct mock_server *server = frame->server;
+  if (frame->used) {
+    wl_resource_post_error(resource,
+        ZWLR_SCREENCOPY_FRAME_V1_ERROR_ALREADY_USED,
+        "frame has already been copied");
+    return;
+  }
+  frame->used = true;
+
+  struct wl_shm_buffer *shm = wl_shm_buffer_get(buffer);
+  if (shm == NULL
+      || wl_shm_buffer_get_format(shm) != WL_SHM_FORMAT_XRGB8888
+      || wl_shm_buffer_get_width(shm) != frame->width
+      || wl_shm_buffer_get_height(shm) != frame->height
+      || wl_shm_buffer_get_stride(shm) < frame->width * 4) {
+    wl_resource_post_error(resource,
+        ZWLR_SCREENCOPY_FRAME_V1_ERROR_INVALID_BUFFER,
+        "buffer doesn't match the advertised format");
+    return;
+  }
+  if (frame->head == NULL) {
+    frame_fail(frame);
+    return;
+  }
+  if (server->fail_captures > 0) {
+    server->fail_captures--;
+    frame_fail(frame);
+    return;
+  }
+
+  frame->buffer = buffer;
+  frame->buffer_destroy.notify = frame_handle_buffer_destroy;
+  wl_resource_add_destroy_listener(buffer, &frame->buffer_destroy);
+
+  if (server->capture_latency > 0) {
+    frame->timer = wl_event_loop_add_timer(server->loop, frame_timer, frame);
+    wl_event_source_timer_update(frame->timer, server->capture_latency);
+  } else {
+    frame_finish(frame);
+  }
+}
+
+static const struct zwlr_screencopy_frame_v1_interface frame_impl = {
+  .copy = frame_copy,
+  .destroy = destroy_resource,
+};
+
+static void frame_destroy(struct wl_resource *resource) {
+  struct mock_frame *frame = wl_resource_get_user_data(resource);
+  if (frame->timer != NULL)
+    wl_event_source_remove(frame->timer);
+  frame_unlink_buffer(frame);
+  wl_list_remove(&frame->link);
+  free(frame);
+}
+
+static void create_frame(struct wl_client *client,
+    struct wl_resource *manager, uint32_t id, struct wl_resource *output,
+    bool region) {
+  struct mock_server *server = wl_resource_get_user_data(manager);
+  struct mock_head *head = wl_resource_get_user_data(output);
+  struct mock_frame *frame = calloc(1, sizeof(*frame));
+  if (frame == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  frame->resource = wl_resource_create(client,
+      &zwlr_screencopy_frame_v1_interface,
+      wl_resource_get_version(manager), id);
+  if (frame->resource == NULL) {
+    free(frame);
+    wl_client_post_no_memory(client);
+    return;
+  }
+  frame->server = server;
+  wl_resource_set_implementation(frame->resource, &frame_impl, frame,
+      frame_destroy);
+
+  /* regions aren't needed by wdisplays, so they always fail */
+  if (head == NULL || head->mode == NULL || region) {
+    wl_list_init(&frame->link);
+    frame_fail(frame);
+    return;
+  }
+  frame->head = head;
+  frame->width = head->mode->width;
+  frame->height = head->mode->height;
+  wl_list_insert(&head->frames, &frame->link);
+  zwlr_screencopy_frame_v1_send_buffer(frame->resource,
+      WL_SHM_FORMAT_XRGB8888, frame->width, frame->height, frame->width * 4);
+}
+
+static void copy_manager_capture_output(struct wl_client *client,
+    struct wl_resource *resource, uint32_t frame, int32_t overlay_cursor,
+    struct wl_resource *output) {
+  create_frame(client, resource, frame, output, false);
+}
+
+static void copy_manager_capture_output_region(struct wl_client *client,
+    struct wl_resource *resource, uint32_t frame, int32_t overlay_cursor,
+    struct wl_resource *output, int32_t x, int32_t y,
+    int32_t width, int32_t height) {
+  create_frame(client, resource, frame, output, true);
+}
+
+static const struct zwlr_screencopy_manager_v1_interface copy_manager_impl = {
+  .capture_output = copy_manager_capture_output,
+  .capture_output_region = copy_manager_capture_output_region,
+  .destroy = destroy_resource,
+};
+
+static void copy_manager_bind(struct wl_client *client, void *data,
+    uint32_t version, uint32_t id) {
+  struct wl_resource *resource = wl_resource_create(client,
+      &zwlr_screencopy_manager_v1_interface, version, id);
+  if (resource == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  wl_resource_set_implementation(resource, &copy_manager_impl, data, NULL);
+}
+
+/* heads */
+
+static struct mock_head *find_head(struct mock_server *server,
+    const char *name) {
+  struct mock_head *head;
+  wl_list_for_each(head, &server->heads, link) {
+    if (strcmp(head->name, name) == 0)
+      return head;
+  }
+  return NULL;
+}
+
+static bool parse_mode(const char *str,
+    int32_t *width, int32_t *height, int32_t *refresh) {
+  char *end;
+  double hz = 60.;
+  long w = strtol(str, &end, 10);
+  if (*end != 'x')
+    return false;
+  long h = strtol(end + 1, &end, 10);
+  if (*end == '@')
+    hz = strtod(end + 1, &end);
+  if (*end != '\0' || w <= 0 || h <= 0 || hz <= 0.)
+    return false;
+  *width = w;
+  *height = h;
+  *refresh = (int32_t) (hz * 1000. + .5);
+  return true;
+}
+
+static struct mock_head *add_head(struct mock_server *server,
+    const char *name, char **modes, int n_modes) {
+  struct mock_head *head = calloc(1, sizeof(*head));
+  if (head == NULL)
+    return NULL;
+  head->server = server;
+  head->name = strdup(name);
+  head->enabled = true;
+  head->scale = wl_fixed_from_int(1);
+  head->color = (0x203050 + 0x2a1c0e * server->next_head++) & 0xffffff;
+  wl_list_init(&head->modes);
+  wl_list_init(&head->head_resources);
+  wl_list_init(&head->output_resources);
+  wl_list_init(&head->xdg_resources);
+  wl_list_init(&head->frames);
+
+  for (int i = 0; i < n_modes; i++) {
+    int32_t width, height, refresh;
+    if (!parse_mode(modes[i], &width, &height, &refresh)) {
+      fprintf(stderr, "Invalid mode %s for %s\n", modes[i], name);
+      continue;
+    }
+    struct mock_mode *mode = add_mode(head, width, height, refresh);
+    if (head->mode == NULL && mode != NULL) {
+      mode->preferred = true;
+      head->mode = mode;
+    }
+  }
+
+  /* new heads go to the right of everything else */
+  struct mock_head *other;
+  wl_list_for_each(other, &server->heads, link) {
+    int32_t width, height;
+    mode_logical_size(other, &width, &height);
+    if (other->enabled && other->x + width > head->x)
+      head->x = other->x + width;
+  }
+  wl_list_insert(server->heads.prev, &head->link);
+
+  struct wl_resource *manager;
+  wl_resource_for_each(manager, &server->manager_resources) {
+    announce_head(head, manager);
+  }
+  sync_output_global(head);
+  server->stats.hotplugs++;
+  return head;
+}
+
+static void remove_head(struct mock_head *head) {
+  struct mock_head_resource *hr, *hr_tmp;
+  wl_list_for_each_safe(hr, hr_tmp, &head->head_resources, link) {
+    struct wl_resource *mode;
+    wl_resource_for_each(mode, &hr->modes) {
+      zwlr_output_mode_v1_send_finished(mode);
+      wl_resource_set_user_data(mode, NULL);
+    }
+    zwlr_output_head_v1_send_finished(hr->resource);
+    hr->head = NULL;
+    wl_list_remove(&hr->link);
+    wl_list_init(&hr->link);
+  }
+
+  struct mock_frame *frame, *frame_tmp;
+  wl_list_for_each_safe(frame, frame_tmp, &head->frames, link) {
+    if (frame->timer != NULL) {
+      wl_event_source_remove(frame->timer);
+      frame->timer = NULL;
+    }
+    if (frame->used)
+      frame_fail(frame);
+    else
+      frame_detach(frame);
+  }
+
+  head->enabled = false;
+  sync_output_global(head);
+  head->server->stats.hotplugs++;
+
+  struct mock_mode *mode, *mode_tmp;
+  wl_list_for_each_safe(mode, mode_tmp, &head->modes, link) {
+    wl_list_remove(&mode->link);
+    free(mode);
+  }
+  wl_list_remove(&head->link);
+  free(head->name);
+  free(head);
+}
+
+/* script */
+
+static void run_script(struct mock_server *server);
+
+static int script_timer(void *data) {
+  run_script(data);
+  return 0;
+}
+
+static bool parse_count(const char *str, unsigned *out) {
+  char *end;
+  errno = 0;
+  unsigned long value = str != NULL ? strtoul(str, &end, 10) : 0;
+  if (str == NULL || errno != 0 || *end != '\0')
+    return false;
+  *out = value;
+  return true;
+}
+
+static bool run_command(struct mock_server *server, char **argv, int argc) {
+  const char *cmd = argv[0];
+  unsigned value;
+  struct mock_head *head = argc > 1 ? find_head(server, argv[1]) : NULL;
+
+  if (strcmp(cmd, "add") == 0 && argc >= 3) {
+    if (head != NULL) {
+      fprintf(stderr, "Head %s already exists\n", argv[1]);
+      return false;
+    }
+    add_head(server, argv[1], argv + 2, argc - 2);
+    send_done(server);
+  } else if (strcmp(cmd, "remove") == 0 && head != NULL) {
+    remove_head(head);
+    send_done(server);
+  } else if ((strcmp(cmd, "enable") == 0 || strcmp(cmd, "disable") == 0)
+      && head != NULL) {
+    head->enabled = cmd[0] == 'e';
+    update_head(head);
+    send_done(server);
+  } else if (strcmp(cmd, "move") == 0 && head != NULL && argc == 4) {
+    head->x = atoi(argv[2]);
+    head->y = atoi(argv[3]);
+    update_head(head);
+    send_done(server);
+  } else if (strcmp(cmd, "storm") == 0 && parse_count(argv[1], &value)) {
+    /* replug the last head as fast as the event loop allows */
+    if (wl_list_empty(&server->heads))
+      return true;
+    head = wl_container_of(server->heads.prev, head, link);
+    if (head->mode == NULL)
+      return true;
+    char *name = strdup(head->name);
+    char mode[64];
+    snprintf(mode, sizeof(mode), "%dx%d@%.3f", head->mode->width,
+        head->mode->height, head->mode->refresh / 1000.);
+    char *modes[] = { mode };
+    for (unsigned i = 0; i < value; i++) {
+      remove_head(head);
+      send_done(server);
+      head = add_head(server, name, modes, 1);
+      send_done(server);
+    }
+    free(name);
+  } else if (strcmp(cmd, "apply-latency") == 0
+      && parse_count(argv[1], &value)) {
+    server->apply_latency = value;
+  } else if (strcmp(cmd, "capture-latency") == 0
+      && parse_count(argv[1], &value)) {
+    server->capture_latency = value;
+  } else if (strcmp(cmd, "fail-applies") == 0
+      && parse_count(argv[1], &value)) {
+    server->fail_applies = value;
+  } else if (strcmp(cmd, "cancel-applies") == 0
+      && parse_count(argv[1], &value)) {
+    server->cancel_applies = value;
+  } else if (strcmp(cmd, "fail-captures") == 0
+      && parse_count(argv[1], &value)) {
+    server->fail_captures = value;
+  } else if (strcmp(cmd, "exit") == 0) {
+    wl_display_terminate(server->display);
+  } else {
+    fprintf(stderr, "Invalid script command: %s\n", cmd);
+    return false;
+  }
+  return true;
+}
+
+static void run_script(struct mock_server *server) {
+  while (server->script_pos < server->script_len) {
+    char *line = server->script[server->script_pos++];
+    char *argv[MAX_ARGS];
+    int argc = 0;
+    for (char *tok = strtok(line, " \t\n"); tok != NULL && argc < MAX_ARGS;
+        tok = strtok(NULL, " \t\n")) {
+      if (tok[0] == '#')
+        break;
+      argv[argc++] = tok;
+    }
+    if (argc == 0)
+      continue;
+
+    unsigned msecs;
+    if (strcmp(argv[0], "wait") == 0 && argc == 2
+        && parse_count(argv[1], &msecs)) {
+      if (msecs == 0)
+        continue;
+      wl_event_source_timer_update(server->script_timer, msecs);
+      return;
+    }
+    if (!run_command(server, argv, argc)) {
+      wl_display_terminate(server->display);
+      return;
+    }
+  }
+}
+
+static bool load_script(struct mock_server *server, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  char *line = NULL;
+  size_t size = 0;
+  while (getline(&line, &size, file) != -1) {
+    char **script = realloc(server->script,
+        (server->script_len + 1) * sizeof(*script));
+    if (script == NULL)
+      break;
+    server->script = script;
+    server->script[server->script_len++] = strdup(line);
+  }
+  free(line);
+  fclose(file);
+  return true;
+}
+
+static int handle_signal(int signum, void *data) {
+  struct mock_server *server = data;
+  wl_display_terminate(server->display);
+  return 0;
+}
+
+static void print_stats(const struct mock_stats *stats) {
+  fprintf(stderr, "applies: %u, tests: %u "
+      "(succeeded %u, failed %u, cancelled %u)\n",
+      stats->applies, stats->tests,
+      stats->succeeded, stats->failed, stats->cancelled);
+  fprintf(stderr, "captures: %u (failed %u, %" PRIu64 " bytes)\n",
+      stats->captures, stats->capture_failures, stats->capture_bytes);
+  fprintf(stderr, "hotplugs: %u\n", stats->hotplugs);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s [options]\n"
+      "  --socket NAME           listen on NAME instead of a free socket\n"
+      "  --heads N               start with N heads (default %d)\n"
+      "  --script FILE           run the commands in FILE\n"
+      "  --apply-latency MS      delay apply and test results\n"
+      "  --capture-latency MS    delay screencopy frames\n"
+      "  --fail-applies N        fail the next N applies and tests\n"
+      "  --cancel-applies N      cancel the next N applies and tests\n"
+      "  --fail-captures N       fail the next N captures\n",
+      argv0, DEFAULT_HEADS);
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+    { "socket", required_argument, NULL, 's' },
+    { "heads", required_argument, NULL, 'n' },
+    { "script", required_argument, NULL, 'f' },
+    { "apply-latency", required_argument, NULL, 'a' },
+    { "capture-latency", required_argument, NULL, 'c' },
+    { "fail-applies", required_argument, NULL, 'F' },
+    { "cancel-applies", required_argument, NULL, 'C' },
+    { "fail-captures", required_argument, NULL, 'X' },
+    { "help", no_argument, NULL, 'h' },
+    { 0 },
+  };
+
+  struct mock_server server = { 0 };
+  const char *socket_name = NULL;
+  const char *script = NULL;
+  unsigned heads = DEFAULT_HEADS;
+  unsigned value;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+    if (opt == 's') {
+      socket_name = optarg;
+      continue;
+    }
+    if (opt == 'f') {
+      script = optarg;
+      continue;
+    }
+    if (opt == 'h' || opt == '?' || !parse_count(optarg, &value)) {
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    switch (opt) {
+    case 'n': heads = value; break;
+    case 'a': server.apply_latency = value; break;
+    case 'c': server.capture_latency = value; break;
+    case 'F': server.fail_applies = value; break;
+    case 'C': server.cancel_applies = value; break;
+    case 'X': server.fail_captures = value; break;
+    }
+  }
+
+  server.display = wl_display_create();
+  server.loop = wl_display_get_event_loop(server.display);
+  wl_list_init(&server.heads);
+  wl_list_init(&server.manager_resources);
+  server.serial = wl_display_next_serial(server.display);
+
+  if (socket_name != NULL
+      ? wl_display_add_socket(server.display, socket_name) != 0
+      : (socket_name = wl_display_add_socket_auto(server.display)) == NULL) {
+    fprintf(stderr, "Failed to open a Wayland socket: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  wl_display_init_shm(server.display);
+  wl_global_create(server.display, &zwlr_output_manager_v1_interface, 1,
+      &server, manager_bind);
+  wl_global_create(server.display, &zxdg_output_manager_v1_interface, 2,
+      &server, xdg_output_manager_bind);
+  wl_global_create(server.display, &zwlr_screencopy_manager_v1_interface, 1,
+      &server, copy_manager_bind);
+
+  for (unsigned i = 0; i < heads; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "HEADLESS-%u", i + 1);
+    char *modes[] = { "1920x1080@60", "1280x720@60" };
+    add_head(&server, name, modes, 2);
+  }
+  server.stats.hotplugs = 0;
+
+  if (script != NULL && !load_script(&server, script))
+    return EXIT_FAILURE;
+  server.script_timer = wl_event_loop_add_timer(server.loop, script_timer,
+      &server);
+
+  struct wl_event_source *sigint = wl_event_loop_add_signal(server.loop,
+      SIGINT, handle_signal, &server);
+  struct wl_event_source *sigterm = wl_event_loop_add_signal(server.loop,
+      SIGTERM, handle_signal, &server);
+
+  printf("WAYLAND_DISPLAY=%s\n", socket_name);
+  fflush(stdout);
+
+  /* from the loop, so that an early exit isn't lost before it starts */
+  wl_event_source_timer_update(server.script_timer, 1);
+  wl_display_run(server.display);
+
+  print_stats(&server.stats);
+
+  wl_event_source_remove(sigint);
+  wl_event_source_remove(sigterm);
+  wl_event_source_remove(server.script_timer);
+  wl_display_destroy_clients(server.display);
+  struct mock_head *head, *tmp;
+  wl_list_for_each_safe(head, tmp, &server.heads, link) {
+    remove_head(head);
+  }
+  wl_display_destroy(server.display);
+
+  for (size_t i = 0; i < server.script_len; i++)
+    free(server.script[i]);
+  free(server.script);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,234 @@
+/* SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+
+/*
+ * Times wd_gl_render with 1 to HEADS_MAX synthetic heads, drawing into an
+ * offscreen framebuffer on a surfaceless EGL display. No compositor or GPU is
+ * needed: with Mesa, LIBGL_ALWAYS_SOFTWARE=1 renders on llvmpipe.
+ *
+ * Each pass renders the canvas repeatedly, once with no new previews and once
+ * with every preview uploaded on every frame, as while capturing. submit is
+ * the mean time spent in wd_gl_render, and p50/p99 are percentiles of the
+ * frame time including glFinish.
+ *
+ * Usage: render-bench [FRAMES] [PREVIEW_WIDTHxPREVIEW_HEIGHT]
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <epoxy/egl.h>
+#include <epoxy/gl.h>
+
+#include "wdisplays.h"
+
+#define VIEWPORT_WIDTH 1280
+#define VIEWPORT_HEIGHT 720
+#define DEFAULT_FRAMES 100
+#define EXIT_SKIP 77 // meson reports the benchmark as skipped
+
+struct timing {
+  double submit; // usecs per frame
+  uint64_t p50;
+  uint64_t p99;
+};
+
+static int compare_usecs(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t now_usecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool setup_egl(void) {
+  if (!epoxy_has_egl_extension(EGL_NO_DISPLAY,
+        "EGL_MESA_platform_surfaceless")) {
+    fprintf(stderr, "EGL_MESA_platform_surfaceless is not supported\n");
+    return false;
+  }
+  EGLDisplay display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA,
+      EGL_DEFAULT_DISPLAY, NULL);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+    fprintf(stderr, "Can't initialize the surfaceless EGL display\n");
+    return false;
+  }
+  if (!epoxy_has_egl_extension(display, "EGL_KHR_surfaceless_context")
+      || !epoxy_has_egl_extension(display, "EGL_KHR_no_config_context")) {
+    fprintf(stderr, "EGL needs surfaceless and configless contexts\n");
+    return false;
+  }
+  static const EGLint attribs[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 2,
+    EGL_NONE,
+  };
+  eglBindAPI(EGL_OPENGL_ES_API);
+  EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR,
+      EGL_NO_CONTEXT, attribs);
+  if (context == EGL_NO_CONTEXT
+      || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+    fprintf(stderr, "Can't create a GLES 2 context\n");
+    return false;
+  }
+  fprintf(stderr, "Rendering with %s\n", glGetString(GL_RENDERER));
+  return true;
+}
+
+/* GtkGLArea renders into a framebuffer object too */
+static bool setup_framebuffer(void) {
+  GLuint texture, framebuffer;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, VIEWPORT_WIDTH, VIEWPORT_HEIGHT,
+      0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+      GL_TEXTURE_2D, texture, 0);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "The offscreen framebuffer is incomplete\n");
+    return false;
+  }
+  glViewport(0, 0, VIEWPORT_WIDTH, VIEWPORT_HEIGHT);
+  return true;
+}
+
+static uint8_t *make_preview(unsigned width, unsigned height) {
+  uint8_t *pixels = malloc((size_t) width * height * 4);
+  if (pixels == NULL)
+    return NULL;
+  for (unsigned y = 0; y < height; y++) {
+    for (unsigned x = 0; x < width; x++) {
+      uint8_t *p = pixels + ((size_t) y * width + x) * 4;
+      p[0] = x;
+      p[1] = y;
+      p[2] = (x / 32 + y / 32) % 2 ? 0xc0 : 0x40;
+      p[3] = 0xff;
+    }
+  }
+  return pixels;
+}
+
+/* lays the heads out in a grid, with the first one hovered */
+static void place_heads(struct wd_render_data *info,
+    struct wd_render_head_data *heads, unsigned n, uint8_t *pixels,
+    unsigned width, unsigned height) {
+  unsigned cols = ceil(sqrt(n));
+  unsigned rows = (n + cols - 1) / cols;
+  float cell_width = (float) VIEWPORT_WIDTH / cols;
+  float cell_height = (float) VIEWPORT_HEIGHT / rows;
+  wl_list_init(&info->heads);
+  for (unsigned i = 0; i < n; i++) {
+    struct wd_render_head_data *head = &heads[i];
+    *head = (struct wd_render_head_data) {
+      .x1 = (i % cols) * cell_width + 4.f,
+      .y1 = (i / cols) * cell_height + 4.f,
+      .x2 = (i % cols + 1) * cell_width - 4.f,
+      .y2 = (i / cols + 1) * cell_height - 4.f,
+      .active = { .rotation = i % 4 },
+      .pixels = pixels,
+      .tex_stride = width * 4,
+      .tex_width = width,
+      .tex_height = height,
+      .preview = true,
+      .hovered = i == 0,
+    };
+    wl_list_insert(&info->heads, &head->link);
+  }
+}
+
+static struct timing run(struct wd_gl_data *gl, struct wd_render_data *info,
+    unsigned frames, bool upload, uint64_t *tick) {
+  uint64_t submit = 0;
+  uint64_t *totals = calloc(frames, sizeof(*totals));
+  for (unsigned f = 0; f < frames; f++) {
+    ++*tick;
+    if (upload) {
+      struct wd_render_head_data *head;
+      wl_list_for_each(head, &info->heads, link) {
+        head->updated_at = *tick;
+      }
+    }
+    uint64_t start = now_usecs();
+    wd_gl_render(gl, info, *tick);
+    uint64_t submitted = now_usecs();
+    glFinish();
+    submit += submitted - start;
+    totals[f] = now_usecs() - start;
+  }
+  qsort(totals, frames, sizeof(*totals), compare_usecs);
+  struct timing timing = {
+    .submit = (double) submit / frames,
+    .p50 = totals[(frames - 1) / 2],
+    .p99 = totals[(frames - 1) * 99 / 100],
+  };
+  free(totals);
+  return timing;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned frames = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_FRAMES;
+  unsigned width = 640;
+  unsigned height = 360;
+  if (frames == 0
+      || (argc > 2 && sscanf(argv[2], "%ux%u", &width, &height) != 2)
+      || width == 0 || height == 0) {
+    fprintf(stderr, "Usage: %s [FRAMES] [PREVIEW_WIDTHxPREVIEW_HEIGHT]\n",
+        argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!setup_egl())
+    return EXIT_SKIP;
+  if (!setup_framebuffer())
+    return EXIT_FAILURE;
+  uint8_t *pixels = make_preview(width, height);
+  if (pixels == NULL)
+    return EXIT_FAILURE;
+
+  static struct wd_render_head_data heads[HEADS_MAX];
+  struct wd_render_data info = {
+    .fg_color = { 1.f, 1.f, 1.f, 1.f },
+    .bg_color = { .2f, .2f, .2f, 1.f },
+    .border_color = { .5f, .5f, .5f, 1.f },
+    .selection_color = { .2f, .4f, .8f, 1.f },
+    .viewport_width = VIEWPORT_WIDTH,
+    .viewport_height = VIEWPORT_HEIGHT,
+    .width = VIEWPORT_WIDTH,
+    .height = VIEWPORT_HEIGHT,
+  };
+  struct wd_gl_data *gl = wd_gl_setup();
+  uint64_t tick = 0;
+
+  printf("%d frames, %ux%u previews, usecs per frame\n",
+      frames, width, height);
+  printf("%6s %10s %10s %10s %10s %10s %10s %12s\n", "heads",
+      "submit", "p50", "p99", "up submit", "up p50", "up p99", "up KiB/frame");
+  for (unsigned n = 1; n <= HEADS_MAX; n *= 2) {
+    place_heads(&info, heads, n, pixels, width, height);
+    /* the first upload allocates the textures, keep it out of the timings */
+    run(gl, &info, 1, true, &tick);
+
+    struct timing idle = run(gl, &info, frames, false, &tick);
+    uint64_t upload_bytes = info.stats.upload_bytes;
+    struct timing upload = run(gl, &info, frames, true, &tick);
+    upload_bytes = info.stats.upload_bytes - upload_bytes;
+
+    printf("%6u %10.1f %10" PRIu64 " %10" PRIu64 " %10.1f %10" PRIu64
+        " %10" PRIu64 " %12.1f\n", n, idle.submit, idle.p50, idle.p99,
+        upload.submit, upload.p50, upload.p99, upload_bytes / 1024. / frames);
+  }
+
+  wd_gl_cleanup(gl);
+  free(pixels);
+  return glGetError() == GL_NO_ERROR ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+# SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+# SPDX-License-Identifier: CC0-1.0
+
+"""Usage: startup-bench.py [--runs N] WDISPLAYS [ARGS...]
+
+Starts WDISPLAYS N times (10 by default) in the running Wayland session and
+stops it as soon as its window is shown. Prints the startup time wdisplays
+logs itself, and the wall time from spawning it to that log line, as min,
+median and max. Exits with 77, which meson reports as a skipped benchmark,
+when there is no Wayland session.
+"""
+
+import os
+import re
+import statistics
+import subprocess
+import sys
+import threading
+import time
+
+STARTUP_RE = re.compile(r'startup with (\d+) heads took ([0-9.]+)ms')
+TIMEOUT_SECS = 10
+EXIT_SKIP = 77
+
+
+def run_once(cmd):
+    env = dict(os.environ, G_MESSAGES_DEBUG='all')
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, env=env, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, text=True)
+    timer = threading.Timer(TIMEOUT_SECS, proc.kill)
+    timer.start()
+    try:
+        for line in proc.stderr:
+            match = STARTUP_RE.search(line)
+            if match:
+                wall = (time.monotonic() - start) * 1000
+                return int(match[1]), float(match[2]), wall
+        return None
+    finally:
+        timer.cancel()
+        proc.terminate()
+        proc.wait()
+
+
+def summary(values):
+    return 'min {:.1f}ms, median {:.1f}ms, max {:.1f}ms'.format(
+        min(values), statistics.median(values), max(values))
+
+
+def main(argv):
+    runs = 10
+    if argv[:1] == ['--runs'] and len(argv) > 1 and argv[1].isdigit():
+        runs = int(argv[1])
+        argv = argv[2:]
+    if not argv or runs == 0:
+        sys.exit(__doc__)
+    if 'WAYLAND_DISPLAY' not in os.environ:
+        print('No Wayland session to start wdisplays in', file=sys.stderr)
+        return EXIT_SKIP
+
+    logged = []
+    wall = []
+    for _ in range(runs):
+        result = run_once(argv)
+        if result is None:
+            sys.exit('wdisplays exited or hung before showing its window. '
+                     'Is another instance already running?')
+        heads, logged_ms, wall_ms = result
+        logged.append(logged_ms)
+        wall.append(wall_ms)
+
+    print('{} runs with {} heads'.format(runs, heads))
+    print('window shown: ' + summary(logged))
+    print('wall time:    ' + summary(wall))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+# SPDX-FileCopyrightText: 2020 Jason Francis <jason@cycles.network>
+# SPDX-License-Identifier: CC0-1.0
+
+"""Usage: with-mock.py [--repeat N] MOCK [MOCK ARGS...] -- COMMAND [ARGS...]
+
+Runs COMMAND against a private instance of the mock compositor. Exits with the
+status of COMMAND, or with that of the mock if its script ended the session
+first.
+
+With --repeat, COMMAND runs N times in a row against the same mock and the
+wall time of each run, from spawning it to its exit, is summarized on stdout.
+"""
+
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def run_timed(cmd, env, repeat):
+    times = []
+    for _ in range(repeat):
+        start = time.monotonic()
+        status = subprocess.call(cmd, env=env, stdout=subprocess.DEVNULL)
+        times.append((time.monotonic() - start) * 1000)
+        if status != 0:
+            return status
+    print('{} runs: min {:.1f}ms, median {:.1f}ms, max {:.1f}ms'.format(
+        repeat, min(times), statistics.median(times), max(times)))
+    return 0
+
+
+def main(argv):
+    repeat = None
+    if argv[:1] == ['--repeat'] and len(argv) > 1 and argv[1].isdigit():
+        repeat = int(argv[1])
+        argv = argv[2:]
+    if '--' not in argv or repeat == 0:
+        sys.exit(__doc__)
+    split = argv.index('--')
+    mock_cmd, cmd = argv[:split], argv[split + 1:]
+
+    with tempfile.TemporaryDirectory() as runtime_dir:
+        env = dict(os.environ, XDG_RUNTIME_DIR=runtime_dir)
+        mock = subprocess.Popen(mock_cmd, env=env, stdout=subprocess.PIPE,
+                                text=True)
+        line = mock.stdout.readline()
+        if not line.startswith('WAYLAND_DISPLAY='):
+            mock.wait()
+            sys.exit('The mock compositor failed to start')
+        env['WAYLAND_DISPLAY'] = line.strip().split('=', 1)[1]
+
+        if repeat is not None:
+            status = run_timed(cmd, env, repeat)
+        else:
+            status = subprocess.call(cmd, env=env)
+        if status != 0:
+            # the command may have failed because the mock is shutting down
+            try:
+                return mock.wait(timeout=1)
+            except subprocess.TimeoutExpired:
+                pass
+        mock.terminate()
+        mock.wait()
+        return status
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))